@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <png.h>
 
@@ -160,9 +161,116 @@ create_bitmap_error:
     return bm;
 }
 
+/** word with the lowest bit of every byte set */
+#define SPAN_ONES UINT64_C(0x0101010101010101)
+
+/** find the first pixel from x which is (or is not) transparent
+ *
+ * Eight pixels are compared at a time so long runs are crossed quickly.
+ *
+ * @param match Look for a transparent pixel rather than an opaque one.
+ */
+static uint32_t
+bitmap_span_find(const uint8_t *pxl,
+                 uint32_t x,
+                 uint32_t width,
+                 unsigned int transparent,
+                 bool match)
+{
+    uint64_t pattern = SPAN_ONES * transparent;
+    uint64_t word;
+
+    while ((x + 8) <= width) {
+        memcpy(&word, pxl + x, sizeof(word));
+        word ^= pattern;
+        if (match) {
+            /* any byte equal to the transparent value is now zero */
+            if (((word - SPAN_ONES) & ~word & (SPAN_ONES << 7)) != 0) {
+                break;
+            }
+        } else if (word != 0) {
+            break;
+        }
+        x += 8;
+    }
+
+    while ((x < width) && ((pxl[x] == transparent) != match)) {
+        x++;
+    }
+
+    return x;
+}
+
+/* exported method documented in bitmap.h */
+bool
+bitmap_spans(bitmap *bm, unsigned int transparent)
+{
+    const uint8_t *pxl;
+    bitmap_span *span;
+    uint32_t alloc = 64;
+    uint32_t count = 0;
+    uint32_t row_loop;
+    uint32_t x;
+    uint32_t start;
+
+    if (bm->span_row != NULL) {
+        return true;
+    }
+
+    bm->span_row = malloc((bm->height + 1) * sizeof(uint32_t));
+    bm->span = malloc(alloc * sizeof(bitmap_span));
+    if ((bm->span_row == NULL) || (bm->span == NULL)) {
+        goto bitmap_spans_error;
+    }
+
+    for (row_loop = 0; row_loop < bm->height; row_loop++) {
+        pxl = bm->data + (row_loop * bm->width);
+        bm->span_row[row_loop] = count;
+
+        x = 0;
+        while (x < bm->width) {
+            if (transparent > 255) {
+                start = 0;
+                x = bm->width;
+            } else {
+                start = bitmap_span_find(pxl, x, bm->width, transparent, false);
+                if (start == bm->width) {
+                    break;
+                }
+                x = bitmap_span_find(pxl, start + 1, bm->width, transparent, true);
+            }
+
+            if (count == alloc) {
+                alloc *= 2;
+                span = realloc(bm->span, alloc * sizeof(bitmap_span));
+                if (span == NULL) {
+                    goto bitmap_spans_error;
+                }
+                bm->span = span;
+            }
+            bm->span[count].start = start;
+            bm->span[count].end = x;
+            count++;
+        }
+    }
+    bm->span_row[bm->height] = count;
+
+    return true;
+
+bitmap_spans_error:
+    free(bm->span_row);
+    free(bm->span);
+    bm->span_row = NULL;
+    bm->span = NULL;
+
+    return false;
+}
+
 void
 free_bitmap(bitmap *bm)
 {
+    free(bm->span_row);
+    free(bm->span);
     free(bm->data);
     free(bm);
 }
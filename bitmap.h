@@ -12,15 +12,37 @@
 #ifndef PNG23D_BITMAP_H
 #define PNG23D_BITMAP_H 1
 
+/** run of pixels on a row which are not transparent */
+typedef struct bitmap_span {
+    uint32_t start; /**< first pixel of the run */
+    uint32_t end; /**< pixel after the last pixel of the run */
+} bitmap_span;
+
 /** 8bpp greyscale bitmap representation of image */
 typedef struct bitmap {
     uint8_t *data; /**< bitmap data */
     uint32_t width; /**< width of data */
     uint32_t height; /**< height of data */
+
+    bitmap_span *span; /**< runs of opaque pixels of every row in order */
+    uint32_t *span_row; /**< index of the first run of each row and the
+                         * total number of runs, NULL until they are found
+                         */
 } bitmap;
 
 bitmap *create_bitmap(const char *filename);
 
+/** find the runs of pixels which are not transparent on every row
+ *
+ * The runs are found once, later calls return immediately, so generators
+ * and outputs can iterate the runs instead of every pixel and their cost
+ * follows the opaque content rather than the size of the image.
+ *
+ * @param transparent The transparent value or above 255 for none.
+ * @return true if the runs are available.
+ */
+bool bitmap_spans(bitmap *bm, unsigned int transparent);
+
 void free_bitmap(bitmap *bm);
 
 #endif
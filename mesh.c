@@ -44,11 +44,13 @@ static void
 debug_mesh_fini(struct mesh *mesh, unsigned int start)
 {
     unsigned int floop;
-    struct vertex *v0 = vertex_from_index(mesh, start);
+    struct facet *f0;
 
-    if (mesh->dumpfile == NULL)
+    if ((mesh->dumpfile == NULL) || (mesh->f == NULL))
         return;
 
+    f0 = vertex_first_facet(mesh, start);
+
     fprintf(mesh->dumpfile, "<h2>Final mesh</h2>");
 
     fprintf(mesh->dumpfile,
@@ -57,8 +59,8 @@ debug_mesh_fini(struct mesh *mesh, unsigned int start)
 
     fprintf(mesh->dumpfile,"<p>Mesh of all facets with common normal</p>\n<svg width=\"%d\" height=\"%d\" xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\">\n", DUMP_SVG_SIZE, DUMP_SVG_SIZE);
 
-    for (floop = 0; floop < mesh->fcount; floop++) {
-        if (same_normal(&mesh->f[floop].n, &v0->facets[0]->n)) {
+    for (floop = 0; (f0 != NULL) && (floop < mesh->fcount); floop++) {
+        if (same_normal(&mesh->f[floop].n, &f0->n)) {
 
             fprintf(mesh->dumpfile,
                     "<polygon points=\"%.1f,%.1f %.1f,%.1f %.1f,%.1f\" style=\"fill:lime;stroke:black;stroke-width=1\"/>\n",
@@ -102,12 +104,86 @@ struct mesh *new_mesh(void)
 
 
 
+/** release the vertex adjacency and indexing tables */
+static void
+free_mesh_index(struct mesh *mesh)
+{
+    free(mesh->bloom_table);
+    mesh->bloom_table = NULL;
+    free(mesh->vhash);
+    mesh->vhash = NULL;
+
+    free(mesh->vcorner);
+    mesh->vcorner = NULL;
+    free(mesh->cnext);
+    mesh->cnext = NULL;
+    free(mesh->cprev);
+    mesh->cprev = NULL;
+}
+
+/* exported method documented in mesh.h */
+bool compact_mesh(struct mesh *mesh)
+{
+    struct cfacet *cf;
+    uint32_t floop;
+
+    assert(mesh->indexed);
+
+    if (mesh->cf != NULL) {
+        return true; /* already compact */
+    }
+
+    /* the mesh is final so the debug output can be completed */
+    debug_mesh_fini(mesh, 4);
+
+    free_mesh_index(mesh);
+
+    /* compact facets are smaller so are converted in place, each facet is
+     * read before its compact form is written and never overwrites a later
+     * facet.
+     */
+    cf = (struct cfacet *)mesh->f;
+    for (floop = 0; floop < mesh->fcount; floop++) {
+        struct cfacet cfacet;
+
+        cfacet.n = mesh->f[floop].n;
+        cfacet.i[0] = mesh->f[floop].i[0];
+        cfacet.i[1] = mesh->f[floop].i[1];
+        cfacet.i[2] = mesh->f[floop].i[2];
+        cf[floop] = cfacet;
+    }
+
+    mesh->f = NULL;
+    mesh->falloc = 0;
+    mesh->cf = realloc(cf, (mesh->fcount + 1) * sizeof(struct cfacet));
+    if (mesh->cf == NULL) {
+        mesh->cf = cf;
+    }
+
+    /* trim the vertex array to the vertices in use */
+    if (mesh->valloc > (mesh->vcount + 1)) {
+        struct vertex *v;
+
+        v = realloc(mesh->v, (mesh->vcount + 1) * sizeof(struct vertex));
+        if (v != NULL) {
+            mesh->v = v;
+            mesh->valloc = mesh->vcount + 1;
+        }
+    }
+
+    return true;
+}
+
 /* exported method documented in mesh.h */
 void free_mesh(struct mesh *mesh)
 {
     debug_mesh_fini(mesh, 4);
-    free(mesh->bloom_table);
+
+    free_mesh_index(mesh);
+    free(mesh->v);
+
     free(mesh->f);
+    free(mesh->cf);
 }
 
 
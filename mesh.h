@@ -28,6 +28,9 @@ typedef struct pnt {
 /** A indexed vertex */
 typedef unsigned int idxvtx;
 
+/** Corner index marking the end of a vertex corner list */
+#define NO_CORNER UINT32_MAX
+
 /** facet
  *
  * A facet is a triangle with its normal
@@ -38,37 +41,60 @@ struct facet {
     idxvtx i[3]; /** triangle indexed vertices */
 };
 
+/** compact facet
+ *
+ * Once a mesh has been indexed and simplified the facet vertex locations
+ * only duplicate the indexed vertices so the facets are compacted into this
+ * form which holds only the normal and the vertex indexes.
+ */
+struct cfacet {
+    pnt n; /**< surface normal */
+    idxvtx i[3]; /**< triangle indexed vertices */
+};
+
 /** An indexed vertex within the mesh. */
 struct vertex {
     struct pnt pnt; /**< the location of this vertex */
     unsigned int fcount; /**< the number of facets that use this vertex */
-    struct facet *facets[]; /**< facets that use this vertex */
 };
 
+struct gen_index;
+
 /** A 3d triangle mesh. */
 struct mesh {
     /* facets */
     struct facet *f; /**< array of facets */
     uint32_t fcount; /**< number of valid facets in the array */
     uint32_t falloc; /**< numer of facets currently allocated */
+    struct cfacet *cf; /**< compacted facets, replaces f once compacted */
+    bool truncated; /**< facets were dropped as the array could not grow */
 
     /* indexed vertices */
     struct vertex *v; /**< array of vertices */
     idxvtx vcount; /**< number of valid vertices in the array */
     idxvtx valloc; /**< numer of vertices currently allocated */
+    bool indexed; /**< facet vertex indexes are valid */
 
     /* mesh parameters */
     uint32_t width; /**< conversion source width */
     uint32_t height; /**< conversion source height */
+    bool lattice; /**< all vertices lie on the integer generation lattice */
+    struct gen_index *gindex; /**< vertex index used during generation */
+
+    /* corner table topology, corner n is vertex n % 3 of facet n / 3 */
+    uint32_t *vcorner; /**< first corner using each vertex */
+    uint32_t *cnext; /**< next corner around the same vertex */
+    uint32_t *cprev; /**< previous corner around the same vertex */
 
-    /* indexing parameters */
-    unsigned int vertex_fcount; /* number of facets a vertex can belong to */
+    /* vertex hash index */
+    idxvtx *vhash; /**< open addressed table of vertex index + 1, 0 is empty */
+    uint32_t vhash_size; /**< number of entries in hash table (power of two) */
 
     /* bloom filter */
-    uint8_t *bloom_table; /**< table for bloom filter */
-    unsigned int bloom_table_entries; /**< Number of entries (bits) it bloom */
-    /** number of times the hash is applied with a differnt salt value
-     * (sometimes referred to as the number of functions)
+    uint64_t *bloom_table; /**< table for bloom filter */
+    uint32_t bloom_blocks; /**< Number of cache line sized blocks in bloom */
+    /** number of bits set within a block for each entry (sometimes referred
+     * to as the number of functions)
      */
     unsigned int bloom_iterations;
 
@@ -93,16 +119,96 @@ void free_mesh(struct mesh *mesh);
 /** initialise debugging on mesh */
 void debug_mesh_init(struct mesh *mesh, const char* filename);
 
+/** compact an indexed mesh
+ *
+ * Converts the facets into compact facets and releases the facet vertex
+ * copies, the adjacency and the indexing tables. The mesh may not be
+ * indexed or simplified again afterwards.
+ */
+bool compact_mesh(struct mesh *mesh);
+
 /** calculate vertex location from its index */
 static inline struct vertex *
 vertex_from_index(struct mesh *mesh, idxvtx ivtx)
 {
-    uint8_t *vtx = (uint8_t *)mesh->v +
-                   (ivtx *
-                    (sizeof(struct vertex) +
-                     (sizeof(struct facet*) * mesh->vertex_fcount)));
-    return (struct vertex *)vtx;
+    return mesh->v + ivtx;
 };
 
+/** facet a corner belongs to */
+static inline struct facet *
+facet_from_corner(struct mesh *mesh, uint32_t corner)
+{
+    return mesh->f + (corner / 3);
+}
+
+/** vertex index at a corner */
+static inline idxvtx
+corner_vertex(struct mesh *mesh, uint32_t corner)
+{
+    return mesh->f[corner / 3].i[corner % 3];
+}
+
+/** surface normal of a facet in whichever form the facets are held */
+static inline struct pnt *
+facet_normal(struct mesh *mesh, uint32_t fidx)
+{
+    if (mesh->cf != NULL) {
+        return &mesh->cf[fidx].n;
+    }
+    return &mesh->f[fidx].n;
+}
+
+/** location of a facet vertex in whichever form the facets are held */
+static inline struct pnt *
+facet_pnt(struct mesh *mesh, uint32_t fidx, unsigned int vloop)
+{
+    if (mesh->cf != NULL) {
+        return &vertex_from_index(mesh, mesh->cf[fidx].i[vloop])->pnt;
+    }
+    return &mesh->f[fidx].v[vloop];
+}
+
+/** indexed vertex of a facet in whichever form the facets are held */
+static inline idxvtx
+facet_index(struct mesh *mesh, uint32_t fidx, unsigned int vloop)
+{
+    if (mesh->cf != NULL) {
+        return mesh->cf[fidx].i[vloop];
+    }
+    return mesh->f[fidx].i[vloop];
+}
+
+/** first facet using a vertex
+ *
+ * Without the corner table the facets are searched, which is only done when
+ * completing the debug output of a mesh that was not simplified.
+ */
+static inline struct facet *
+vertex_first_facet(struct mesh *mesh, idxvtx ivtx)
+{
+    uint32_t floop;
+
+    if (mesh->vcorner != NULL) {
+        if (mesh->vcorner[ivtx] == NO_CORNER) {
+            return NULL;
+        }
+        return facet_from_corner(mesh, mesh->vcorner[ivtx]);
+    }
+
+    if (mesh->indexed == false) {
+        return NULL;
+    }
+
+    for (floop = 0; floop < mesh->fcount; floop++) {
+        if ((mesh->f[floop].i[0] == ivtx) ||
+            (mesh->f[floop].i[1] == ivtx) ||
+            (mesh->f[floop].i[2] == ivtx)) {
+            return &mesh->f[floop];
+        }
+    }
+
+    return NULL;
+}
+
 
 #endif
@@ -13,15 +13,18 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "option.h"
 #include "bitmap.h"
 #include "mesh.h"
 #include "mesh_gen.h"
 #include "mesh_math.h"
+#include "mesh_index.h"
 
 
 enum faces {
@@ -33,93 +36,373 @@ enum faces {
     FACE_BACK = 32,
 };
 
-/** calculate which faces of a cube are adjacent solid cubes
+/** number of pixels in each occupancy mask word */
+#define GEN_MASK_BITS 64
+
+/** one byte per bit of the index with the value of the bit
+ *
+ * Multiplying an entry by a face leaves that face in the bytes of the set
+ * bits so eight locations are classified with a multiply and an or.
  */
-static uint32_t
-mesh_gen_get_face(bitmap *bm,
-                  unsigned int x,
-                  unsigned int y,
-                  unsigned int z,
-                  struct options *options)
-{
-    uint32_t faces = 0;
-    unsigned int transparent = options->transparent;
-    unsigned int pxl_lvl;
-    uint8_t pxl_val;
+static uint64_t gen_mask_spread[256];
+
+/** occupancy of a row and the rows above and below it for a single level
+ *
+ * Each row holds a bit for every pixel set if it is opaque. The padding
+ * bits beyond the width of the bitmap and rows outside it are clear.
+ */
+struct gen_mask {
+    unsigned int words; /**< number of words in each row */
+    unsigned int y; /**< the row the masks are centred on */
+    uint64_t *prev; /**< occupancy of the row above */
+    uint64_t *cur; /**< occupancy of the row */
+    uint64_t *next; /**< occupancy of the row below */
+    uint64_t *rows; /**< allocation holding the three rows */
+};
 
-#define Z_LVL_VAL(val) ((val) * (256 / options->levels))
+/** runs of opaque pixels on a row
+ *
+ * Rows outside the bitmap have no runs.
+ *
+ * @param count Updated with the number of runs.
+ */
+static inline const bitmap_span *
+mesh_gen_row_spans(bitmap *bm, int y, unsigned int *count)
+{
+    if ((y < 0) || ((unsigned int)y >= bm->height)) {
+        *count = 0;
+        return bm->span;
+    }
 
-    /* value at which pixel is transparent */
-    pxl_lvl = Z_LVL_VAL(z);
+    *count = bm->span_row[y + 1] - bm->span_row[y];
+    return bm->span + bm->span_row[y];
+}
 
-    /* pixel value at sample point */
-    pxl_val = bm->data[(y * bm->width) + x];
+/** number of ranges mesh_gen_span_cover() can produce for a bitmap */
+#define GEN_COVER_MAX(bm) (3 * (((bm)->width / 2) + 1))
 
-    if ((pxl_val == transparent) ||
-        (pxl_val < pxl_lvl)) {
-        /* only opaque squares can have faces */
-        return faces;
+/** find the ranges of locations near the opaque pixels of a few rows
+ *
+ * The runs of up to three rows are each extended to the right, clipped and
+ * merged into ordered ranges which do not overlap so locations which must
+ * be visited for the rows are visited once and in order.
+ *
+ * @param extend The number of locations to extend each run by.
+ * @param limit The location after the last one which may be visited.
+ * @param ranges Array of GEN_COVER_MAX() entries to hold the ranges.
+ * @return The number of ranges.
+ */
+static unsigned int
+mesh_gen_span_cover(bitmap *bm,
+                    int ylo,
+                    int yhi,
+                    unsigned int extend,
+                    unsigned int limit,
+                    bitmap_span *ranges)
+{
+    const bitmap_span *row[3];
+    unsigned int left[3];
+    unsigned int rows = 0;
+    unsigned int count = 0;
+    unsigned int best;
+    unsigned int rloop;
+    unsigned int start;
+    unsigned int end;
+    int yloop;
+
+    for (yloop = ylo; yloop <= yhi; yloop++) {
+        row[rows] = mesh_gen_row_spans(bm, yloop, &left[rows]);
+        rows++;
     }
 
-    /* start with all faces set */
-    faces = FACE_TOP | FACE_BOT |
-            FACE_BACK | FACE_FRONT |
-            FACE_LEFT | FACE_RIGHT;
+    for (;;) {
+        best = rows;
+        for (rloop = 0; rloop < rows; rloop++) {
+            if ((left[rloop] > 0) &&
+                ((best == rows) || (row[rloop]->start < row[best]->start))) {
+                best = rloop;
+            }
+        }
+        if (best == rows) {
+            break;
+        }
 
-    /* z axis faces */
+        start = row[best]->start;
+        end = row[best]->end + extend;
+        if (end > limit) {
+            end = limit;
+        }
+        row[best]++;
+        left[best]--;
 
-    /* only the bottom layer has a front face */
-    if (z > 0) {
-        faces = faces & ~FACE_FRONT;
+        if ((count > 0) && (start <= ranges[count - 1].end)) {
+            if (end > ranges[count - 1].end) {
+                ranges[count - 1].end = end;
+            }
+        } else {
+            ranges[count].start = start;
+            ranges[count].end = end;
+            count++;
+        }
     }
 
-    if ((z < (options->levels - 1)) &&
-        (pxl_val >= Z_LVL_VAL(z + 1))) {
-        faces = faces & ~FACE_BACK;
+    return count;
+}
+
+/** set the bits of a range of locations in an occupancy mask */
+static inline void
+mesh_gen_mask_set(uint64_t *mask, unsigned int start, unsigned int end)
+{
+    unsigned int w = start / GEN_MASK_BITS;
+    unsigned int wlast = (end - 1) / GEN_MASK_BITS;
+    uint64_t first = ~(uint64_t)0 << (start % GEN_MASK_BITS);
+    uint64_t last = ~(uint64_t)0 >> ((GEN_MASK_BITS - 1) - ((end - 1) % GEN_MASK_BITS));
+
+    if (w == wlast) {
+        mask[w] |= first & last;
+        return;
     }
 
-    /* x axis faces */
-    if (x > 0) {
-        /* pixel value left of sample point */
-        pxl_val = bm->data[(y * bm->width) + (x - 1)];
-        if ((pxl_val != transparent) &&
-            (pxl_val >= pxl_lvl)) {
-            faces = faces & ~FACE_LEFT;
-        }
+    mask[w++] |= first;
+    while (w < wlast) {
+        mask[w++] = ~(uint64_t)0;
     }
+    mask[w] |= last;
+}
 
-    if (x < (bm->width - 1)) {
-        /* pixel value right of sample point */
-        pxl_val = bm->data[(y * bm->width) + (x + 1)];
-        if ((pxl_val != transparent) &&
-            (pxl_val >= pxl_lvl)) {
-            faces = faces & ~FACE_RIGHT;
-        }
+/** build the occupancy mask of a row from its runs of opaque pixels */
+static void
+mesh_gen_mask_row(bitmap *bm, int y, unsigned int words, uint64_t *mask)
+{
+    const bitmap_span *span;
+    unsigned int count;
+    unsigned int sloop;
+
+    memset(mask, 0, words * sizeof(uint64_t));
+
+    span = mesh_gen_row_spans(bm, y, &count);
+    for (sloop = 0; sloop < count; sloop++) {
+        mesh_gen_mask_set(mask, span[sloop].start, span[sloop].end);
     }
+}
 
-    if (y > 0) {
-        pxl_val = bm->data[((y - 1) * bm->width) + x ];
-        if ((pxl_val != transparent) &&
-            (pxl_val >= pxl_lvl)) {
-            faces = faces & ~FACE_TOP;
-        }
+/** allocate the occupancy masks for a band of rows */
+static bool
+mesh_gen_mask_init(struct gen_mask *mask, bitmap *bm)
+{
+    mask->words = (bm->width + GEN_MASK_BITS - 1) / GEN_MASK_BITS;
+    mask->y = UINT_MAX;
+    mask->rows = malloc((3 * mask->words + 1) * sizeof(uint64_t));
+    if (mask->rows == NULL) {
+        return false;
+    }
+    mask->prev = mask->rows;
+    mask->cur = mask->prev + mask->words;
+    mask->next = mask->cur + mask->words;
+
+    return true;
+}
+
+/** centre the occupancy masks on a row
+ *
+ * Moving on to the following row reuses two of the masks so each row is
+ * built once for a band.
+ */
+static void
+mesh_gen_mask_rows(struct gen_mask *mask, bitmap *bm, unsigned int y)
+{
+    uint64_t *tmp;
+
+    if ((mask->y != UINT_MAX) && (y == (mask->y + 1))) {
+        tmp = mask->prev;
+        mask->prev = mask->cur;
+        mask->cur = mask->next;
+        mask->next = tmp;
+    } else {
+        mesh_gen_mask_row(bm, (int)y - 1, mask->words, mask->prev);
+        mesh_gen_mask_row(bm, y, mask->words, mask->cur);
+    }
+    mesh_gen_mask_row(bm, y + 1, mask->words, mask->next);
+    mask->y = y;
+}
+
+/** exposed faces of a word of locations */
+struct gen_mask_faces {
+    uint64_t solid; /**< opaque locations */
+    uint64_t left; /**< opaque locations with a left face */
+    uint64_t right; /**< opaque locations with a right face */
+    uint64_t top; /**< opaque locations with a top face */
+    uint64_t bot; /**< opaque locations with a bottom face */
+};
+
+/** find the exposed faces of a word of the centre row
+ *
+ * A location has a face on each side where its neighbour is not opaque so
+ * the faces of 64 locations are found with a few shifts and logical
+ * operations.
+ */
+static inline void
+mesh_gen_mask_word(const struct gen_mask *mask,
+                   unsigned int w,
+                   struct gen_mask_faces *f)
+{
+    uint64_t c = mask->cur[w];
+    uint64_t left = c << 1;
+    uint64_t right = c >> 1;
+
+    if (w > 0) {
+        left |= mask->cur[w - 1] >> (GEN_MASK_BITS - 1);
+    }
+    if ((w + 1) < mask->words) {
+        right |= mask->cur[w + 1] << (GEN_MASK_BITS - 1);
+    }
+
+    f->solid = c;
+    f->left = c & ~left;
+    f->right = c & ~right;
+    f->top = c & ~mask->prev[w];
+    f->bot = c & ~mask->next[w];
+}
+
+/** calculate the faces of a word of locations on the centre row */
+static inline void
+mesh_gen_mask_word_faces(const struct gen_mask *mask,
+                         unsigned int w,
+                         unsigned int width,
+                         uint8_t *faces)
+{
+    struct gen_mask_faces f;
+    unsigned int x = w * GEN_MASK_BITS;
+    unsigned int count = width - x;
+    unsigned int b;
+    uint64_t v;
+
+    if (count > GEN_MASK_BITS) {
+        count = GEN_MASK_BITS;
+    }
+
+    mesh_gen_mask_word(mask, w, &f);
+
+    if ((f.solid == ~(uint64_t)0) &&
+        ((f.left | f.right | f.top | f.bot) == 0)) {
+        memset(faces + x, FACE_FRONT | FACE_BACK, count);
+        return;
     }
 
-    if (y < (bm->height - 1)) {
-        pxl_val = bm->data[((y + 1) * bm->width) + x ];
-        if ((pxl_val != transparent) &&
-            (pxl_val >= pxl_lvl)) {
-            faces = faces & ~FACE_BOT;
+    for (b = 0; b < count; b += 8) {
+        v = (gen_mask_spread[(f.solid >> b) & 0xff] * (FACE_FRONT | FACE_BACK)) |
+            (gen_mask_spread[(f.left >> b) & 0xff] * FACE_LEFT) |
+            (gen_mask_spread[(f.right >> b) & 0xff] * FACE_RIGHT) |
+            (gen_mask_spread[(f.top >> b) & 0xff] * FACE_TOP) |
+            (gen_mask_spread[(f.bot >> b) & 0xff] * FACE_BOT);
+        memcpy(faces + x + b, &v, ((count - b) < 8) ? (count - b) : 8);
+    }
+}
+
+/** calculate the faces of the opaque locations on the centre row
+ *
+ * Each opaque location of a single level has a face on every side not
+ * adjacent to another opaque location. Only the words holding the runs of
+ * the row are classified, every other location is left alone.
+ *
+ * @param span The runs of opaque pixels on the centre row.
+ * @param faces Array of the bitmap width to hold the face of each location.
+ */
+static void
+mesh_gen_mask_faces(const struct gen_mask *mask,
+                    unsigned int width,
+                    const bitmap_span *span,
+                    unsigned int count,
+                    uint8_t *faces)
+{
+    unsigned int sloop;
+    unsigned int w;
+    unsigned int wlast;
+    unsigned int wnext = 0;
+
+    for (sloop = 0; sloop < count; sloop++) {
+        w = span[sloop].start / GEN_MASK_BITS;
+        wlast = (span[sloop].end - 1) / GEN_MASK_BITS;
+        if (w < wnext) {
+            w = wnext;
         }
+        for (; w <= wlast; w++) {
+            mesh_gen_mask_word_faces(mask, w, width, faces);
+        }
+        wnext = wlast + 1;
+    }
+}
+
+/** rolling vertex index used to index a mesh as it is generated
+ *
+ * The generators emit facets a row at a time, working down the image, so a
+ * vertex can only be shared with facets on the current lattice row or the
+ * one before it. Each of the two rows holds the vertex index (plus one) of
+ * every x,z lattice location on it. A row slot is reused two rows later;
+ * stale entries are detected by checking the y coordinate of the vertex
+ * they refer to so rows never need clearing.
+ */
+struct gen_index {
+    int xsize; /**< number of x lattice locations on a row */
+    int zsize; /**< number of z lattice locations on a row */
+    bool planes; /**< z locations are only the base or the surface plane */
+    idxvtx *row[2]; /**< vertex index plus one of each location */
+};
+
+/** find or create the indexed vertex for a generated lattice point */
+static inline idxvtx
+mesh_gen_vertex(struct mesh *mesh, struct pnt *pnt)
+{
+    struct gen_index *gindex = mesh->gindex;
+    idxvtx *entry;
+    int x = pnt->x;
+    int y = pnt->y;
+    int z = pnt->z;
+
+    /* a surface has one vertex above each location and one on the base */
+    if (gindex->planes) {
+        z = (pnt->z != 0);
+    }
+
+    assert((x >= 0) && (x < gindex->xsize));
+    assert((z >= 0) && (z < gindex->zsize));
+
+    entry = gindex->row[y & 1] + (z * gindex->xsize) + x;
+
+    if ((*entry == 0) ||
+        (vertex_from_index(mesh, *entry - 1)->pnt.y != pnt->y)) {
+        *entry = mesh_new_vertex(mesh, pnt) + 1;
     }
 
+    return *entry - 1;
+}
+
+/** ensure the facet array can hold a number of facets without growing */
+static bool
+mesh_gen_reserve(struct mesh *mesh, uint32_t fcount)
+{
+    struct facet *f;
 
+    if (fcount <= mesh->falloc) {
+        return true;
+    }
 
+    f = realloc(mesh->f, fcount * sizeof(struct facet));
+    if (f == NULL) {
+        return false;
+    }
+    mesh->f = f;
+    mesh->falloc = fcount;
 
-    return faces;
+    return true;
 }
 
-/** add a facet to the mesh */
+/** add a facet to the mesh
+ *
+ * @return true if the facet was added, false if it was degenerate or the
+ *         facet array could not be extended, which also marks the mesh as
+ *         truncated.
+ */
 static bool
 mesh_add_facet(struct mesh *mesh,
           float vx0,float vy0, float vz0,
@@ -130,9 +413,13 @@ mesh_add_facet(struct mesh *mesh,
     bool degenerate = false;
 
     if ((mesh->fcount + 1) > mesh->falloc) {
-        /* array needs extending */
-        mesh->f = realloc(mesh->f, (mesh->falloc + 1000) * sizeof(struct facet));
-        mesh->falloc += 1000;
+        /* array needs extending, the generators reserve the facets they
+         * will add so this only happens for merged faces.
+         */
+        if (!mesh_gen_reserve(mesh, (mesh->falloc * 2) + 1000)) {
+            mesh->truncated = true;
+            return false;
+        }
     }
 
     newfacet = mesh->f + mesh->fcount;
@@ -156,352 +443,550 @@ mesh_add_facet(struct mesh *mesh,
 
     /* do not add degenerate facets */
     if (!degenerate) {
+        if (mesh->gindex != NULL) {
+            newfacet->i[0] = mesh_gen_vertex(mesh, &newfacet->v[0]);
+            newfacet->i[1] = mesh_gen_vertex(mesh, &newfacet->v[1]);
+            newfacet->i[2] = mesh_gen_vertex(mesh, &newfacet->v[2]);
+        }
         mesh->fcount++;
     }
 
-    return degenerate;
+    return !degenerate;
 }
 
-#define ADDF(xa,ya,za,xb,yb,zb,xc,yc,zc) mesh_add_facet(mesh,           \
-        x + (xa * width), y + (ya * height), z + (za * depth),          \
-        x + (xb * width), y + (yb * height), z + (zb * depth),          \
-        x + (xc * width), y + (yc * height), z + (zc * depth))
-
-/* generates cube facets for a location */
-static void
-mesh_gen_cube(struct mesh *mesh,
-            float x, float y, float z,
-            float width, float height, float depth,
-            uint32_t faces)
-{
-    if (faces != 0) {
-        mesh->cubes++;
-    }
-
-    switch (faces & 0xf) {
-    case 0: /* empty */
-        break;
-
-    case FACE_LEFT:
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-        break;
+/** Largest number of facets a location can generate */
+#define GEN_CASE_MAX_FACETS 12
 
-    case FACE_RIGHT:
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
+/** facets generated for one combination of faces
+ *
+ * Each facet vertex is a corner of the unit cube encoded as x | y << 1 |
+ * z << 2.
+ */
+struct gen_case {
+    unsigned int count; /**< number of facets */
+    uint8_t corner[GEN_CASE_MAX_FACETS][3]; /**< facet vertex corners */
+};
 
-    case (FACE_LEFT | FACE_RIGHT) :
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
+#define GC(x,y,z) ((x) | ((y) << 1) | ((z) << 2))
+
+/** the two facets covering each cube face in the order they are output */
+static const uint8_t gen_face_facets[6][2][3] = {
+    /* bottom */
+    { { GC(0,0,0), GC(1,0,0), GC(0,0,1) }, { GC(0,0,1), GC(1,0,0), GC(1,0,1) } },
+    /* top */
+    { { GC(0,1,0), GC(0,1,1), GC(1,1,0) }, { GC(0,1,1), GC(1,1,1), GC(1,1,0) } },
+    /* left */
+    { { GC(0,0,0), GC(0,0,1), GC(0,1,0) }, { GC(0,1,0), GC(0,0,1), GC(0,1,1) } },
+    /* right */
+    { { GC(1,0,0), GC(1,1,0), GC(1,0,1) }, { GC(1,1,0), GC(1,1,1), GC(1,0,1) } },
+    /* front */
+    { { GC(0,0,0), GC(0,1,0), GC(1,0,0) }, { GC(0,1,0), GC(1,1,0), GC(1,0,0) } },
+    /* back */
+    { { GC(0,0,1), GC(1,0,1), GC(0,1,1) }, { GC(0,1,1), GC(1,0,1), GC(1,1,1) } },
+};
 
-    case FACE_TOP:
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
-        break;
+/** face bits in the order gen_face_facets holds them */
+static const uint32_t gen_face_order[6] = {
+    FACE_BOT, FACE_TOP, FACE_LEFT, FACE_RIGHT, FACE_FRONT, FACE_BACK
+};
 
-    case (FACE_TOP | FACE_LEFT):
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-        break;
+/** marching squares diagonal facets
+ *
+ * Where exactly two adjacent side faces are present the corner is cut off
+ * with a diagonal face and the front and back become triangles. Indexed by
+ * the side faces, the entries are the two diagonal facets followed by the
+ * front and back triangles. Unused entries have every corner zero.
+ */
+static const uint8_t gen_diagonal_facets[16][4][3] = {
+    [FACE_TOP | FACE_LEFT] = {
+        { GC(0,0,0), GC(0,0,1), GC(1,1,0) }, { GC(1,1,0), GC(0,0,1), GC(1,1,1) },
+        { GC(0,0,0), GC(1,1,0), GC(1,0,0) }, { GC(0,0,1), GC(1,0,1), GC(1,1,1) } },
+    [FACE_TOP | FACE_RIGHT] = {
+        { GC(1,0,0), GC(0,1,0), GC(1,0,1) }, { GC(0,1,0), GC(0,1,1), GC(1,0,1) },
+        { GC(1,0,0), GC(0,0,0), GC(0,1,0) }, { GC(1,0,1), GC(0,1,1), GC(0,0,1) } },
+    [FACE_BOT | FACE_LEFT] = {
+        { GC(0,1,0), GC(1,0,0), GC(1,0,1) }, { GC(0,1,0), GC(1,0,1), GC(0,1,1) },
+        { GC(1,0,0), GC(0,1,0), GC(1,1,0) }, { GC(1,0,1), GC(1,1,1), GC(0,1,1) } },
+    [FACE_BOT | FACE_RIGHT] = {
+        { GC(0,0,0), GC(1,1,0), GC(0,0,1) }, { GC(0,0,1), GC(1,1,0), GC(1,1,1) },
+        { GC(0,0,0), GC(0,1,0), GC(1,1,0) }, { GC(0,0,1), GC(1,1,1), GC(0,1,1) } },
+};
 
-    case (FACE_TOP | FACE_RIGHT):
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
+/** facets for every combination of cube faces */
+static struct gen_case gen_cube_cases[64];
 
-    case (FACE_TOP | FACE_LEFT | FACE_RIGHT):
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
+/** facets for every combination of faces with marching squares diagonals */
+static struct gen_case gen_squares_cases[64];
 
-    case FACE_BOT:
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
-        break;
+/** cube facets without the front and back faces the merged planes cover */
+static struct gen_case gen_cube_merged_cases[64];
 
-    case (FACE_BOT | FACE_LEFT):
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-        break;
+/** marching squares facets without the front and back faces the merged
+ * planes cover
+ */
+static struct gen_case gen_squares_merged_cases[64];
 
-    case (FACE_BOT | FACE_RIGHT):
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
+/** Largest number of facets a marching cubes cell generates */
+#define GEN_CELL_MAX_FACETS 5
 
-    case (FACE_BOT | FACE_LEFT | FACE_RIGHT) :
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
+/** marching cubes facets for one combination of solid cell corners
+ *
+ * Each facet vertex is the midpoint of a cell edge encoded in half cell
+ * units as x | y << 2 | z << 4.
+ */
+struct gen_cell_case {
+    unsigned int count; /**< number of facets */
+    uint8_t vertex[GEN_CELL_MAX_FACETS][3]; /**< facet vertex edge midpoints */
+};
 
-    case (FACE_BOT | FACE_TOP):
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
-        break;
+/** the corners at either end of each cell edge */
+static const uint8_t gen_cell_edges[12][2] = {
+    { GC(0,0,0), GC(1,0,0) }, { GC(0,1,0), GC(1,1,0) },
+    { GC(0,0,1), GC(1,0,1) }, { GC(0,1,1), GC(1,1,1) },
+    { GC(0,0,0), GC(0,1,0) }, { GC(1,0,0), GC(1,1,0) },
+    { GC(0,0,1), GC(0,1,1) }, { GC(1,0,1), GC(1,1,1) },
+    { GC(0,0,0), GC(0,0,1) }, { GC(1,0,0), GC(1,0,1) },
+    { GC(0,1,0), GC(0,1,1) }, { GC(1,1,0), GC(1,1,1) },
+};
 
-    case (FACE_BOT | FACE_TOP | FACE_LEFT):
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-        break;
+/** the corners around each cell face and its outward normal */
+static const struct {
+    uint8_t corner[4];
+    int8_t normal[3];
+} gen_cell_faces[6] = {
+    { { GC(0,0,0), GC(0,1,0), GC(0,1,1), GC(0,0,1) }, { -1, 0, 0 } },
+    { { GC(1,0,0), GC(1,1,0), GC(1,1,1), GC(1,0,1) }, { 1, 0, 0 } },
+    { { GC(0,0,0), GC(1,0,0), GC(1,0,1), GC(0,0,1) }, { 0, -1, 0 } },
+    { { GC(0,1,0), GC(1,1,0), GC(1,1,1), GC(0,1,1) }, { 0, 1, 0 } },
+    { { GC(0,0,0), GC(1,0,0), GC(1,1,0), GC(0,1,0) }, { 0, 0, -1 } },
+    { { GC(0,0,1), GC(1,0,1), GC(1,1,1), GC(0,1,1) }, { 0, 0, 1 } },
+};
 
-    case (FACE_BOT | FACE_TOP | FACE_RIGHT):
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
+/** marching cubes facets for every combination of solid cell corners */
+static struct gen_cell_case gen_cell_cases[256];
 
-    case (FACE_BOT | FACE_TOP | FACE_LEFT | FACE_RIGHT):
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
+static void
+gen_case_add(struct gen_case *gcase, const uint8_t corner[3])
+{
+    memcpy(gcase->corner[gcase->count++], corner, 3);
+}
 
-    }
+/** position of a cell corner or edge midpoint in half cell units */
+static inline void
+gen_cell_pos(uint8_t corner, int pos[3])
+{
+    pos[0] = (corner & 1) * 2;
+    pos[1] = ((corner >> 1) & 1) * 2;
+    pos[2] = (corner >> 2) * 2;
+}
 
-    if ((faces & FACE_FRONT) != 0) {
-        ADDF(0,0,0, 0,1,0, 1,0,0);
-        ADDF(0,1,0, 1,1,0, 1,0,0);
-    }
+/** the cell edge joining two corners */
+static unsigned int
+gen_cell_edge(uint8_t ca, uint8_t cb)
+{
+    unsigned int eloop;
 
-    if ((faces & FACE_BACK) != 0) {
-        ADDF(0,0,1, 1,0,1, 0,1,1);
-        ADDF(0,1,1, 1,0,1, 1,1,1);
+    for (eloop = 0; eloop < 12; eloop++) {
+        if (((gen_cell_edges[eloop][0] == ca) && (gen_cell_edges[eloop][1] == cb)) ||
+            ((gen_cell_edges[eloop][0] == cb) && (gen_cell_edges[eloop][1] == ca))) {
+            break;
+        }
     }
-
+    return eloop;
 }
 
-/* generates smoothed facets for a location
+/** add a contour segment across a cell face
  *
- * appies marching squares (ish) to generate facets
+ * The segment runs between the midpoints of two edges and is directed
+ * along the cross product of the direction away from the solid corner and
+ * the outward face normal, which makes every contour loop run anticlockwise
+ * about the outward surface normal.
  *
- * @todo make this table driven as a 64 entry switch is out of hand
+ * @param solid A solid corner of the face on the solid side of the segment.
+ * @param next The contour successor of each edge.
  */
 static void
-mesh_gen_marching_squares(struct mesh *mesh,
-                        float x, float y, float z,
-                        float width, float height, float depth,
-                        uint32_t faces)
+gen_cell_segment(unsigned int ea,
+                 unsigned int eb,
+                 uint8_t solid,
+                 const int8_t normal[3],
+                 int *next)
 {
-    if (faces != 0) {
-        mesh->cubes++;
+    int pa[3], pb[3], pc[3], pd[3];
+    int away[3];
+    int side;
+
+    gen_cell_pos(gen_cell_edges[ea][0], pa);
+    gen_cell_pos(gen_cell_edges[ea][1], pc);
+    gen_cell_pos(gen_cell_edges[eb][0], pb);
+    gen_cell_pos(gen_cell_edges[eb][1], pd);
+    gen_cell_pos(solid, away);
+
+    /* direction from the solid corner to the segment midpoint */
+    away[0] = (pa[0] + pc[0] + pb[0] + pd[0]) - (4 * away[0]);
+    away[1] = (pa[1] + pc[1] + pb[1] + pd[1]) - (4 * away[1]);
+    away[2] = (pa[2] + pc[2] + pb[2] + pd[2]) - (4 * away[2]);
+
+    /* segment direction dotted with away cross normal */
+    side = (((pb[0] + pd[0]) - (pa[0] + pc[0])) *
+            ((away[1] * normal[2]) - (away[2] * normal[1]))) +
+           (((pb[1] + pd[1]) - (pa[1] + pc[1])) *
+            ((away[2] * normal[0]) - (away[0] * normal[2]))) +
+           (((pb[2] + pd[2]) - (pa[2] + pc[2])) *
+            ((away[0] * normal[1]) - (away[1] * normal[0])));
+
+    if (side > 0) {
+        next[ea] = eb;
+    } else {
+        next[eb] = ea;
     }
+}
 
-    switch (faces & 0xf) {
-    case 0: /* empty */
-        break;
-
-    case FACE_LEFT:
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-        break;
-
-    case FACE_RIGHT:
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
-
-    case (FACE_LEFT | FACE_RIGHT) :
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
-
-    case FACE_TOP:
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
-        break;
-
-    case (FACE_TOP | FACE_LEFT):
-        ADDF(0,0,0, 0,0,1, 1,1,0);
-        ADDF(1,1,0, 0,0,1, 1,1,1);
-
-        if ((faces & FACE_FRONT) != 0) {
-            ADDF(0,0,0, 1,1,0, 1,0,0);
-            faces = faces & ~FACE_FRONT;
+/** build the marching cubes facets for every combination of solid corners
+ *
+ * Rather than a hand written table the contour of each combination is
+ * traced. On each cell face the edges with a solid and an empty end are
+ * joined in pairs, where a face has solid corners diagonally opposite each
+ * is cut off on its own. The rule depends only on the face so neighbouring
+ * cells always agree and the surface is closed. The loops the segments
+ * form are fanned into facets.
+ */
+static void
+mesh_gen_cell_cases_init(void)
+{
+    unsigned int cells;
+    unsigned int floop;
+    unsigned int cloop;
+    unsigned int eloop;
+    unsigned int edge;
+    unsigned int loop[12];
+    unsigned int lcount;
+    unsigned int crossing[4];
+    unsigned int ccount;
+    int next[12];
+    bool done[12];
+    struct gen_cell_case *ccase;
+    const uint8_t *corner;
+    uint8_t solid;
+
+#define CELL_SOLID(c) ((cells >> (c)) & 1)
+
+    for (cells = 0; cells < 256; cells++) {
+        for (eloop = 0; eloop < 12; eloop++) {
+            next[eloop] = -1;
+            done[eloop] = false;
         }
 
-        if ((faces & FACE_BACK) != 0) {
-            ADDF(0,0,1, 1,0,1, 1,1,1);
-            faces = faces & ~FACE_BACK;
-        }
+        for (floop = 0; floop < 6; floop++) {
+            corner = gen_cell_faces[floop].corner;
+            ccount = 0;
+            solid = 0xff;
+            for (cloop = 0; cloop < 4; cloop++) {
+                if (CELL_SOLID(corner[cloop]) != CELL_SOLID(corner[(cloop + 1) & 3])) {
+                    crossing[ccount++] = cloop;
+                }
+                if ((solid == 0xff) && CELL_SOLID(corner[cloop])) {
+                    solid = corner[cloop];
+                }
+            }
 
-        break;
+            if (ccount == 2) {
+                gen_cell_segment(gen_cell_edge(corner[crossing[0]],
+                                               corner[(crossing[0] + 1) & 3]),
+                                 gen_cell_edge(corner[crossing[1]],
+                                               corner[(crossing[1] + 1) & 3]),
+                                 solid,
+                                 gen_cell_faces[floop].normal,
+                                 next);
+            } else if (ccount == 4) {
+                /* cut off each solid corner */
+                for (cloop = 0; cloop < 4; cloop++) {
+                    if (!CELL_SOLID(corner[cloop])) {
+                        continue;
+                    }
+                    gen_cell_segment(gen_cell_edge(corner[(cloop + 3) & 3],
+                                                   corner[cloop]),
+                                     gen_cell_edge(corner[cloop],
+                                                   corner[(cloop + 1) & 3]),
+                                     corner[cloop],
+                                     gen_cell_faces[floop].normal,
+                                     next);
+                }
+            }
+        }
 
-    case (FACE_TOP | FACE_RIGHT):
-        ADDF(1,0,0, 0,1,0, 1,0,1);
-        ADDF(0,1,0, 0,1,1, 1,0,1);
+        ccase = &gen_cell_cases[cells];
+        for (eloop = 0; eloop < 12; eloop++) {
+            if ((next[eloop] < 0) || done[eloop]) {
+                continue;
+            }
 
-        if ((faces & FACE_FRONT) != 0) {
-            ADDF(1,0,0, 0,0,0, 0,1,0);
-            faces = faces & ~FACE_FRONT;
-        }
+            lcount = 0;
+            for (edge = eloop; !done[edge]; edge = next[edge]) {
+                done[edge] = true;
+                loop[lcount++] = edge;
+            }
 
-        if ((faces & FACE_BACK) != 0) {
-            ADDF(1,0,1, 0,1,1, 0,0,1);
-            faces = faces & ~FACE_BACK;
+            for (cloop = 2; cloop < lcount; cloop++) {
+                uint8_t *vertex = ccase->vertex[ccase->count++];
+                int pos[3];
+                int end[3];
+                unsigned int vloop;
+                const unsigned int vedge[3] = {
+                    loop[0], loop[cloop - 1], loop[cloop]
+                };
+
+                for (vloop = 0; vloop < 3; vloop++) {
+                    gen_cell_pos(gen_cell_edges[vedge[vloop]][0], pos);
+                    gen_cell_pos(gen_cell_edges[vedge[vloop]][1], end);
+                    vertex[vloop] = ((pos[0] + end[0]) / 2) |
+                                    (((pos[1] + end[1]) / 2) << 2) |
+                                    (((pos[2] + end[2]) / 2) << 4);
+                }
+            }
         }
-        break;
+    }
 
-    case (FACE_TOP | FACE_LEFT | FACE_RIGHT):
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
+#undef CELL_SOLID
+}
 
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
+/** front and back faces of a location output as whole squares
+ *
+ * @param faces The faces present at the location.
+ * @param diagonals The marching squares diagonals are in use.
+ */
+static inline uint32_t
+mesh_gen_square_faces(uint32_t faces, bool diagonals)
+{
+    const uint8_t (*diag)[3] = gen_diagonal_facets[faces & 0xf];
 
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
+    if (diagonals && (diag[0][0] != diag[0][1])) {
+        /* front and back are triangles cut by the diagonal */
+        return 0;
+    }
+    return faces & (FACE_FRONT | FACE_BACK);
+}
 
-    case FACE_BOT:
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
-        break;
+/** build the facet tables for every face combination
+ *
+ * Facets are added in the order bottom, top, left, right, front and back
+ * with diagonals replacing the pair of sides they cut off.
+ */
+static void
+mesh_gen_cases_init(void)
+{
+    static bool initialised = false;
+    uint32_t faces;
+    unsigned int floop;
+    struct gen_case *gcase;
+    const uint8_t (*diag)[3];
 
-    case (FACE_BOT | FACE_LEFT):
-        ADDF(0,1,0, 1,0,0, 1,0,1);
-        ADDF(0,1,0, 1,0,1, 0,1,1);
+    if (initialised) {
+        return;
+    }
 
-        if ((faces & FACE_FRONT) != 0) {
-            ADDF(1,0,0, 0,1,0, 1,1,0);
-            faces = faces & ~FACE_FRONT;
+    for (faces = 0; faces < 64; faces++) {
+        gcase = &gen_cube_cases[faces];
+        for (floop = 0; floop < 6; floop++) {
+            if ((faces & gen_face_order[floop]) != 0) {
+                gen_case_add(gcase, gen_face_facets[floop][0]);
+                gen_case_add(gcase, gen_face_facets[floop][1]);
+            }
         }
 
-        if ((faces & FACE_BACK) != 0) {
-            ADDF(1,0,1, 1,1,1, 0,1,1);
-            faces = faces & ~FACE_BACK;
+        gcase = &gen_squares_cases[faces];
+        diag = gen_diagonal_facets[faces & 0xf];
+        if (diag[0][0] == diag[0][1]) {
+            *gcase = gen_cube_cases[faces];
+            continue;
         }
 
-        break;
-
-    case (FACE_BOT | FACE_RIGHT):
-        ADDF(0,0,0, 1,1,0, 0,0,1);
-        ADDF(0,0,1, 1,1,0, 1,1,1);
-
+        gen_case_add(gcase, diag[0]);
+        gen_case_add(gcase, diag[1]);
         if ((faces & FACE_FRONT) != 0) {
-            ADDF(0,0,0, 0,1,0, 1,1,0);
-            faces = faces & ~FACE_FRONT;
+            gen_case_add(gcase, diag[2]);
         }
-
         if ((faces & FACE_BACK) != 0) {
-            ADDF(0,0,1, 1,1,1, 0,1,1);
-            faces = faces & ~FACE_BACK;
+            gen_case_add(gcase, diag[3]);
         }
+    }
 
-        break;
-
-    case (FACE_BOT | FACE_LEFT | FACE_RIGHT) :
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
-
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
-
-    case (FACE_BOT | FACE_TOP):
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
-
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
-        break;
-
-    case (FACE_BOT | FACE_TOP | FACE_LEFT):
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
+    /* spread each bit of a byte into a byte in memory order */
+    for (floop = 0; floop < 256; floop++) {
+        uint8_t spread[8];
+        unsigned int bit;
 
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
+        for (bit = 0; bit < 8; bit++) {
+            spread[bit] = (floop >> bit) & 1;
+        }
+        memcpy(&gen_mask_spread[floop], spread, sizeof(spread));
+    }
 
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
-        break;
+    /* merging removes the square front and back faces before generation */
+    for (faces = 0; faces < 64; faces++) {
+        gen_cube_merged_cases[faces] =
+            gen_cube_cases[faces & ~mesh_gen_square_faces(faces, false)];
+        gen_squares_merged_cases[faces] =
+            gen_squares_cases[faces & ~mesh_gen_square_faces(faces, true)];
+    }
 
-    case (FACE_BOT | FACE_TOP | FACE_RIGHT):
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
+    mesh_gen_cell_cases_init();
 
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
+    initialised = true;
+}
 
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
+/** add the facets of a face combination at a location */
+static inline void
+mesh_gen_case(struct mesh *mesh,
+              const struct gen_case *gcase,
+              float x, float y, float z,
+              float width, float height, float depth)
+{
+    unsigned int floop;
+    const uint8_t *c;
+
+    for (floop = 0; floop < gcase->count; floop++) {
+        c = gcase->corner[floop];
+        mesh_add_facet(mesh,
+                       x + ((c[0] & 1) * width),
+                       y + (((c[0] >> 1) & 1) * height),
+                       z + ((c[0] >> 2) * depth),
+                       x + ((c[1] & 1) * width),
+                       y + (((c[1] >> 1) & 1) * height),
+                       z + ((c[1] >> 2) * depth),
+                       x + ((c[2] & 1) * width),
+                       y + (((c[2] >> 1) & 1) * height),
+                       z + ((c[2] >> 2) * depth));
+    }
+}
 
-    case (FACE_BOT | FACE_TOP | FACE_LEFT | FACE_RIGHT):
-        ADDF(0,0,0, 1,0,0, 0,0,1);
-        ADDF(0,0,1, 1,0,0, 1,0,1);
+/** add the facets of a face combination at a unit cell
+ *
+ * The cell size is fixed so the corner offsets need no scaling.
+ */
+static inline void
+mesh_gen_case_unit(struct mesh *mesh,
+                   const struct gen_case *gcase,
+                   float x, float y, float z)
+{
+    unsigned int floop;
+    const uint8_t *c;
+
+    for (floop = 0; floop < gcase->count; floop++) {
+        c = gcase->corner[floop];
+        mesh_add_facet(mesh,
+                       x + (c[0] & 1), y + ((c[0] >> 1) & 1), z + (c[0] >> 2),
+                       x + (c[1] & 1), y + ((c[1] >> 1) & 1), z + (c[1] >> 2),
+                       x + (c[2] & 1), y + ((c[2] >> 1) & 1), z + (c[2] >> 2));
+    }
+}
 
-        ADDF(0,1,0, 0,1,1, 1,1,0);
-        ADDF(0,1,1, 1,1,1, 1,1,0);
+/** add the facets of the runs of unit cells on a row
+ *
+ * @param cases The facet table for the finish, selected once per band.
+ * @param frow The face combination of each location on the row.
+ * @param span The runs of opaque pixels on the row.
+ */
+static inline void
+mesh_gen_case_row(struct mesh *mesh,
+                  const struct gen_case *cases,
+                  const uint8_t *frow,
+                  const bitmap_span *span,
+                  unsigned int count,
+                  float y,
+                  float z)
+{
+    const struct gen_case *gcase;
+    unsigned int sloop;
+    unsigned int xloop;
 
-        ADDF(0,0,0, 0,0,1, 0,1,0);
-        ADDF(0,1,0, 0,0,1, 0,1,1);
+    for (sloop = 0; sloop < count; sloop++) {
+        for (xloop = span[sloop].start; xloop < span[sloop].end; xloop++) {
+            gcase = &cases[frow[xloop]];
+            if (gcase->count != 0) {
+                mesh->cubes++;
+                mesh_gen_case_unit(mesh, gcase, xloop, y, z);
+            }
+        }
+    }
+}
 
-        ADDF(1,0,0, 1,1,0, 1,0,1);
-        ADDF(1,1,0, 1,1,1, 1,0,1);
-        break;
+/** add a facet lying in a front or back plane
+ *
+ * The vertices are reordered if required so the facet faces away from the
+ * solid.
+ */
+static inline void
+mesh_gen_plane_facet(struct mesh *mesh,
+                     float ax, float ay,
+                     float bx, float by,
+                     float cx, float cy,
+                     float z, bool back)
+{
+    float cross = ((bx - ax) * (cy - ay)) - ((by - ay) * (cx - ax));
 
+    if ((cross > 0) == back) {
+        mesh_add_facet(mesh, ax, ay, z, bx, by, z, cx, cy, z);
+    } else {
+        mesh_add_facet(mesh, ax, ay, z, cx, cy, z, bx, by, z);
     }
+}
 
-    if ((faces & FACE_FRONT) != 0) {
-        ADDF(0,0,0, 0,1,0, 1,0,0);
-        ADDF(0,1,0, 1,1,0, 1,0,0);
+/** add the facets of a merged rectangle of front or back faces
+ *
+ * Every lattice point on the perimeter of the rectangle is a facet vertex so
+ * the rectangle joins any neighbouring facets without T junctions. The left
+ * edge is fanned from the second bottom point, the right edge from the
+ * penultimate top point and the band between those fans is zipped together.
+ *
+ * @param x The left of the rectangle.
+ * @param y The bottom of the rectangle.
+ * @param width The width of the rectangle.
+ * @param height The height of the rectangle.
+ */
+static void
+mesh_gen_merged_face(struct mesh *mesh,
+                     float x, float y,
+                     unsigned int width, unsigned int height,
+                     float z, bool back)
+{
+    float top = y + height;
+    float right = x + width;
+    unsigned int loop;
+
+    /* left edge fan from (x + 1, y) */
+    for (loop = 0; loop < height; loop++) {
+        mesh_gen_plane_facet(mesh,
+                             x + 1, y,
+                             x, y + loop,
+                             x, y + loop + 1,
+                             z, back);
     }
 
-    if ((faces & FACE_BACK) != 0) {
-        ADDF(0,0,1, 1,0,1, 0,1,1);
-        ADDF(0,1,1, 1,0,1, 1,1,1);
+    /* right edge fan from (right - 1, top) */
+    for (loop = 0; loop < height; loop++) {
+        mesh_gen_plane_facet(mesh,
+                             right - 1, top,
+                             right, y + loop,
+                             right, y + loop + 1,
+                             z, back);
     }
 
+    /* zip the bottom points from x + 1 with the top points from x */
+    for (loop = 0; loop < (width - 1); loop++) {
+        mesh_gen_plane_facet(mesh,
+                             x + loop + 1, y,
+                             x + loop + 2, y,
+                             x + loop, top,
+                             z, back);
+        mesh_gen_plane_facet(mesh,
+                             x + loop + 2, y,
+                             x + loop + 1, top,
+                             x + loop, top,
+                             z, back);
+    }
 }
 
-
-typedef void (meshgenerator)(struct mesh *mesh,
-                        float x, float y, float z,
-                        float width, float height, float depth,
-                          uint32_t faces);
-
 /* generate maching squares
  *
  * this is a simple 2d extrusion of modified marching squares
@@ -512,193 +997,3319 @@ typedef void (meshgenerator)(struct mesh *mesh,
  *     be covered to generate a convex manifold.
  *   - add triangle facets to list for each face present
  *
+ * Only a single level is generated this way, multiple levels use marching
+ * cubes. The facet table is chosen once so merging costs nothing per pixel.
  */
-static bool mesh_gen_squares(struct mesh *mesh, bitmap *bm, options *options)
+static bool
+mesh_gen_squares_rows(struct mesh *mesh,
+                      bitmap *bm,
+                      options *options,
+                      unsigned int ystart,
+                      unsigned int yend,
+                      uint8_t *frow)
 {
+    const struct gen_case *cases = gen_squares_cases;
+    const bitmap_span *span;
+    struct gen_mask mask;
+    unsigned int count;
     unsigned int yloop;
-    unsigned int xloop;
-    unsigned int zloop;
-    uint32_t faces;
-    meshgenerator *meshgen;
 
-    if (options->levels == 1) {
-        meshgen = &mesh_gen_marching_squares;
-    } else {
-        meshgen = &mesh_gen_cube;
+    if (options->merge) {
+        cases = gen_squares_merged_cases;
     }
 
-    for (zloop = 0; zloop < options->levels; zloop++) {
-        for (yloop = 0; yloop < bm->height; yloop++) {
-            for (xloop = 0; xloop < bm->width; xloop++) {
-                faces = mesh_gen_get_face(bm, xloop, yloop, zloop, options);
-                meshgen(mesh, xloop, -(float)yloop, zloop, 1, 1, 1, faces);
-            }
+    if (!mesh_gen_mask_init(&mask, bm)) {
+        return false;
+    }
+
+    for (yloop = ystart; yloop < yend; yloop++) {
+        span = mesh_gen_row_spans(bm, yloop, &count);
+        if (count == 0) {
+            continue;
         }
+        mesh_gen_mask_rows(&mask, bm, yloop);
+        mesh_gen_mask_faces(&mask, bm->width, span, count, frow);
+        mesh_gen_case_row(mesh, cases, frow, span, count, -(float)yloop, 0);
     }
-    
+
+    free(mask.rows);
+
     return true;
 }
 
+/** count the facets the squares generator adds for a range of rows
+ *
+ * Merged front and back faces are counted as whole squares which is never
+ * fewer facets than the merged rectangles covering them.
+ */
+static uint32_t
+mesh_gen_squares_count(bitmap *bm,
+                       options *options,
+                       unsigned int ystart,
+                       unsigned int yend,
+                       uint8_t *frow)
+{
+    const bitmap_span *span;
+    struct gen_mask mask;
+    unsigned int count;
+    unsigned int sloop;
+    unsigned int yloop;
+    unsigned int xloop;
+    uint32_t fcount = 0;
+
+    if (!mesh_gen_mask_init(&mask, bm)) {
+        return 0;
+    }
+
+    for (yloop = ystart; yloop < yend; yloop++) {
+        span = mesh_gen_row_spans(bm, yloop, &count);
+        if (count == 0) {
+            continue;
+        }
+        mesh_gen_mask_rows(&mask, bm, yloop);
+        mesh_gen_mask_faces(&mask, bm->width, span, count, frow);
+        for (sloop = 0; sloop < count; sloop++) {
+            for (xloop = span[sloop].start; xloop < span[sloop].end; xloop++) {
+                fcount += gen_squares_cases[frow[xloop]].count;
+            }
+        }
+    }
+
+    free(mask.rows);
+
+    return fcount;
+}
+
 /* generate cubic mesh
  *
- * consider each pixel in the raster image:
- *   - generate a bitfield indicating on which sides of the pixel faces need to
- *     be covered to generate a convex manifold.
- *   - add triangle facets to list for each face present
+ * consider each pixel in the raster image:
+ *   - generate a bitfield indicating on which sides of the pixel faces need to
+ *     be covered to generate a convex manifold.
+ *   - add triangle facets to list for each face present
+ *
+ * Only a single level is generated this way, multiple levels are height
+ * field columns.
+ */
+static bool
+mesh_gen_cubes_rows(struct mesh *mesh,
+                    bitmap *bm,
+                    options *options,
+                    unsigned int ystart,
+                    unsigned int yend,
+                    uint8_t *frow)
+{
+    const struct gen_case *cases = gen_cube_cases;
+    const bitmap_span *span;
+    struct gen_mask mask;
+    unsigned int count;
+    unsigned int yloop;
+
+    if (options->merge) {
+        cases = gen_cube_merged_cases;
+    }
+
+    if (!mesh_gen_mask_init(&mask, bm)) {
+        return false;
+    }
+
+    for (yloop = ystart; yloop < yend; yloop++) {
+        span = mesh_gen_row_spans(bm, yloop, &count);
+        if (count == 0) {
+            continue;
+        }
+        mesh_gen_mask_rows(&mask, bm, yloop);
+        mesh_gen_mask_faces(&mask, bm->width, span, count, frow);
+        mesh_gen_case_row(mesh, cases, frow, span, count, -(float)yloop, 0);
+    }
+
+    free(mask.rows);
+
+    return true;
+}
+
+/** count the facets the cube generator adds for a range of rows
+ *
+ * Every face is two facets so the faces are counted directly from the
+ * occupancy masks of the words holding the runs of each row without
+ * classifying each location.
+ */
+static uint32_t
+mesh_gen_cubes_count(bitmap *bm,
+                     options *options,
+                     unsigned int ystart,
+                     unsigned int yend,
+                     uint8_t *frow)
+{
+    const bitmap_span *span;
+    struct gen_mask mask;
+    struct gen_mask_faces f;
+    unsigned int count;
+    unsigned int sloop;
+    unsigned int yloop;
+    unsigned int w;
+    unsigned int wlast;
+    unsigned int wnext;
+    uint32_t fcount = 0;
+
+    if (!mesh_gen_mask_init(&mask, bm)) {
+        return 0;
+    }
+
+    for (yloop = ystart; yloop < yend; yloop++) {
+        span = mesh_gen_row_spans(bm, yloop, &count);
+        if (count == 0) {
+            continue;
+        }
+        mesh_gen_mask_rows(&mask, bm, yloop);
+        wnext = 0;
+        for (sloop = 0; sloop < count; sloop++) {
+            w = span[sloop].start / GEN_MASK_BITS;
+            wlast = (span[sloop].end - 1) / GEN_MASK_BITS;
+            if (w < wnext) {
+                w = wnext;
+            }
+            for (; w <= wlast; w++) {
+                mesh_gen_mask_word(&mask, w, &f);
+                fcount += 2 * ((2 * __builtin_popcountll(f.solid)) +
+                               __builtin_popcountll(f.left) +
+                               __builtin_popcountll(f.right) +
+                               __builtin_popcountll(f.top) +
+                               __builtin_popcountll(f.bot));
+            }
+            wnext = wlast + 1;
+        }
+    }
+
+    free(mask.rows);
+
+    return fcount;
+}
+
+/** number of levels filled by the column of a pixel */
+static inline unsigned int
+mesh_gen_column_height(uint8_t pxl_val, options *options, unsigned int step)
+{
+    unsigned int height;
+
+    if (pxl_val == options->transparent) {
+        return 0;
+    }
+
+    height = (pxl_val / step) + 1;
+    if (height > options->levels) {
+        height = options->levels;
+    }
+
+    return height;
+}
+
+/** quantise a row of pixels into column heights
+ *
+ * The row is padded with an empty column at either end and rows outside
+ * the bitmap are empty. Only the pixels of the runs of the row are read.
+ */
+static void
+mesh_gen_column_row(bitmap *bm, options *options, int y, uint16_t *heights)
+{
+    unsigned int step = 256 / options->levels;
+    const bitmap_span *span;
+    const uint8_t *pxl;
+    unsigned int count;
+    unsigned int sloop;
+    unsigned int xloop;
+
+    memset(heights, 0, (bm->width + 2) * sizeof(uint16_t));
+
+    span = mesh_gen_row_spans(bm, y, &count);
+    pxl = bm->data + (y * bm->width);
+    for (sloop = 0; sloop < count; sloop++) {
+        for (xloop = span[sloop].start; xloop < span[sloop].end; xloop++) {
+            heights[xloop + 1] = mesh_gen_column_height(pxl[xloop], options, step);
+        }
+    }
+}
+
+/** column height bits of a merge plane entry */
+#define GEN_MERGE_HEIGHT 0x3ff
+
+/** location is covered by a merged front face */
+#define GEN_MERGE_FRONT 0x4000
+
+/** location is covered by a merged back face */
+#define GEN_MERGE_BACK 0x8000
+
+/** location of a merge plane is still to be covered by a rectangle
+ *
+ * Every location with a column has a front face on the base while the back
+ * faces are on the top of each column so only locations of the same height
+ * can share a back rectangle.
+ *
+ * @param height The height of the column the rectangle is covering.
+ * @param covered The flag marking the face as covered.
+ */
+static inline bool
+mesh_gen_merge_open(uint16_t entry, unsigned int height, uint16_t covered)
+{
+    if (((entry & covered) != 0) || ((entry & GEN_MERGE_HEIGHT) == 0)) {
+        return false;
+    }
+    return (covered == GEN_MERGE_FRONT) ||
+           ((entry & GEN_MERGE_HEIGHT) == height);
+}
+
+/** quantise the rows of a bitmap into the column heights of a merge plane
+ *
+ * Each row is padded with an empty location at either end. When the
+ * marching squares diagonals are in use locations with a diagonal keep
+ * their triangular front and back so are left empty.
+ *
+ * @param stride The number of entries in each row of the plane.
+ */
+static bool
+mesh_gen_merge_heights(bitmap *bm,
+                       options *options,
+                       bool diagonals,
+                       unsigned int stride,
+                       uint16_t *plane)
+{
+    struct gen_mask mask;
+    const bitmap_span *span;
+    unsigned int count;
+    unsigned int sloop;
+    unsigned int yloop;
+    unsigned int xloop;
+    uint16_t *row;
+    uint8_t *faces;
+
+    if (!diagonals) {
+        for (yloop = 0; yloop < bm->height; yloop++) {
+            mesh_gen_column_row(bm, options, yloop, plane + (yloop * stride));
+        }
+        return true;
+    }
+
+    faces = calloc(bm->width + 1, 1);
+    if (faces == NULL) {
+        return false;
+    }
+    if (!mesh_gen_mask_init(&mask, bm)) {
+        free(faces);
+        return false;
+    }
+
+    for (yloop = 0; yloop < bm->height; yloop++) {
+        row = plane + (yloop * stride);
+        memset(row, 0, stride * sizeof(uint16_t));
+
+        span = mesh_gen_row_spans(bm, yloop, &count);
+        if (count == 0) {
+            continue;
+        }
+
+        mesh_gen_mask_rows(&mask, bm, yloop);
+        mesh_gen_mask_faces(&mask, bm->width, span, count, faces);
+
+        for (sloop = 0; sloop < count; sloop++) {
+            for (xloop = span[sloop].start; xloop < span[sloop].end; xloop++) {
+                if (mesh_gen_square_faces(faces[xloop], true) != 0) {
+                    row[xloop + 1] = 1;
+                }
+            }
+        }
+    }
+
+    free(mask.rows);
+    free(faces);
+
+    return true;
+}
+
+/** cover the front or back faces of a merge plane with rectangles
+ *
+ * Each rectangle is grown as far as possible along its row and then down
+ * following rows while they are completely covered.
+ *
+ * @param covered GEN_MERGE_FRONT or GEN_MERGE_BACK for the faces to cover.
+ */
+static void
+mesh_gen_merge_cover(struct mesh *mesh,
+                     bitmap *bm,
+                     unsigned int stride,
+                     uint16_t *plane,
+                     uint16_t covered)
+{
+    unsigned int yloop;
+    unsigned int xloop;
+    unsigned int height;
+    unsigned int rwidth;
+    unsigned int rheight;
+    unsigned int rloop;
+    unsigned int cloop;
+    uint16_t *row;
+    uint16_t *next;
+
+    for (yloop = 0; yloop < bm->height; yloop++) {
+        /* rows without opaque pixels have no faces */
+        if (bm->span_row[yloop] == bm->span_row[yloop + 1]) {
+            continue;
+        }
+
+        for (xloop = 1; xloop <= bm->width; xloop++) {
+            row = plane + (yloop * stride) + xloop;
+            height = *row & GEN_MERGE_HEIGHT;
+
+            if (!mesh_gen_merge_open(*row, height, covered)) {
+                continue;
+            }
+
+            /* grow along the row, the padding stops the last location */
+            rwidth = 1;
+            while (mesh_gen_merge_open(row[rwidth], height, covered)) {
+                rwidth++;
+            }
+
+            /* grow down while the whole width is covered */
+            rheight = 1;
+            while ((yloop + rheight) < bm->height) {
+                next = row + (rheight * stride);
+
+                for (rloop = 0; rloop < rwidth; rloop++) {
+                    if (!mesh_gen_merge_open(next[rloop], height, covered)) {
+                        break;
+                    }
+                }
+                if (rloop != rwidth) {
+                    break;
+                }
+                rheight++;
+            }
+
+            for (rloop = 0; rloop < rheight; rloop++) {
+                next = row + (rloop * stride);
+                for (cloop = 0; cloop < rwidth; cloop++) {
+                    next[cloop] |= covered;
+                }
+            }
+
+            mesh_gen_merged_face(mesh,
+                                 xloop - 1,
+                                 -(float)(yloop + rheight - 1),
+                                 rwidth,
+                                 rheight,
+                                 (covered == GEN_MERGE_FRONT) ? 0 : height,
+                                 covered == GEN_MERGE_BACK);
+        }
+    }
+}
+
+/** merge the front and back faces of each plane into rectangles
+ *
+ * The bitmap is quantised into column heights once. The front faces of
+ * every column lie on the base and are covered in one pass, the back faces
+ * lie on the top of each column and are covered in a second pass where
+ * only columns of the same height are merged.
+ *
+ * @param diagonals The marching squares diagonals are in use so locations
+ *                  with a diagonal keep their triangular front and back.
+ */
+static bool
+mesh_gen_merge_planes(struct mesh *mesh,
+                      bitmap *bm,
+                      options *options,
+                      bool diagonals)
+{
+    unsigned int stride = bm->width + 2;
+    uint16_t *plane;
+
+    plane = malloc((size_t)stride * bm->height * sizeof(uint16_t));
+    if (plane == NULL) {
+        return false;
+    }
+
+    if (!mesh_gen_merge_heights(bm, options, diagonals, stride, plane)) {
+        free(plane);
+        return false;
+    }
+
+    mesh_gen_merge_cover(mesh, bm, stride, plane, GEN_MERGE_FRONT);
+    mesh_gen_merge_cover(mesh, bm, stride, plane, GEN_MERGE_BACK);
+
+    free(plane);
+
+    /* the merged faces were reserved as whole squares, release the excess */
+    if (mesh->falloc > mesh->fcount) {
+        struct facet *f;
+
+        f = realloc(mesh->f, (mesh->fcount + 1) * sizeof(struct facet));
+        if (f != NULL) {
+            mesh->f = f;
+            mesh->falloc = mesh->fcount + 1;
+        }
+    }
+
+    return true;
+}
+
+/** heights of the vertices on one end of a wall
+ *
+ * The wall spans from lo to hi and has a vertex at every height of the
+ * other two columns at the corner which lies between those so it meets
+ * the walls and caps around the corner without T junctions.
+ *
+ * @param ha The height of one of the other columns at the corner.
+ * @param hb The height of the other column at the corner.
+ * @param chain Array of at least four entries filled with the heights.
+ * @return The number of heights in the chain.
+ */
+static inline unsigned int
+mesh_gen_wall_chain(unsigned int lo,
+                    unsigned int hi,
+                    unsigned int ha,
+                    unsigned int hb,
+                    unsigned int *chain)
+{
+    unsigned int count = 0;
+
+    if (ha > hb) {
+        unsigned int tmp = ha;
+        ha = hb;
+        hb = tmp;
+    }
+
+    chain[count++] = lo;
+    if ((ha > lo) && (ha < hi)) {
+        chain[count++] = ha;
+    }
+    if ((hb > lo) && (hb < hi) && (hb != ha)) {
+        chain[count++] = hb;
+    }
+    chain[count++] = hi;
+
+    return count;
+}
+
+/** add a wall facet ordered so its normal faces the given direction */
+static inline void
+mesh_gen_wall_facet(struct mesh *mesh,
+                    float ax, float ay, float az,
+                    float bx, float by, float bz,
+                    float cx, float cy, float cz,
+                    float nx, float ny)
+{
+    float crossx = ((by - ay) * (cz - az)) - ((bz - az) * (cy - ay));
+    float crossy = ((bz - az) * (cx - ax)) - ((bx - ax) * (cz - az));
+
+    if (((crossx * nx) + (crossy * ny)) > 0) {
+        mesh_add_facet(mesh, ax, ay, az, bx, by, bz, cx, cy, cz);
+    } else {
+        mesh_add_facet(mesh, ax, ay, az, cx, cy, cz, bx, by, bz);
+    }
+}
+
+/** add a wall between two columns of different height
+ *
+ * The vertical edges at either end of the wall carry the heights from
+ * mesh_gen_wall_chain() and the wall is zipped between them.
+ *
+ * @param mesh The mesh to add the facets to or NULL to only count them.
+ * @param nx The x direction of the wall normal.
+ * @param ny The y direction of the wall normal.
+ * @return The number of facets in the wall.
+ */
+static uint32_t
+mesh_gen_wall(struct mesh *mesh,
+              float ax, float ay, const unsigned int *achain, unsigned int acount,
+              float bx, float by, const unsigned int *bchain, unsigned int bcount,
+              float nx, float ny)
+{
+    unsigned int aloop = 0;
+    unsigned int bloop = 0;
+
+    if (mesh == NULL) {
+        return (acount - 1) + (bcount - 1);
+    }
+
+    while (((aloop + 1) < acount) || ((bloop + 1) < bcount)) {
+        if (((bloop + 1) == bcount) ||
+            (((aloop + 1) < acount) && (achain[aloop + 1] <= bchain[bloop + 1]))) {
+            mesh_gen_wall_facet(mesh,
+                                ax, ay, achain[aloop],
+                                bx, by, bchain[bloop],
+                                ax, ay, achain[aloop + 1],
+                                nx, ny);
+            aloop++;
+        } else {
+            mesh_gen_wall_facet(mesh,
+                                ax, ay, achain[aloop],
+                                bx, by, bchain[bloop],
+                                bx, by, bchain[bloop + 1],
+                                nx, ny);
+            bloop++;
+        }
+    }
+
+    return (acount - 1) + (bcount - 1);
+}
+
+/** generate or count the height field columns of a range of rows
+ *
+ * Each pixel is quantised once into the height of its column. Every column
+ * has a front face and a cap at its height and walls are added only where
+ * neighbouring columns differ in height, spanning the whole difference.
+ * The top edge of each row is walled with the row and the bottom edge of
+ * the final row with the last band. Only the locations near the runs of
+ * opaque pixels can have facets so no others are visited.
+ *
+ * @param mesh The mesh to add the facets to or NULL to only count them.
+ * @param fcount Updated with the number of facets.
+ */
+static bool
+mesh_gen_columns_band(struct mesh *mesh,
+                      bitmap *bm,
+                      options *options,
+                      unsigned int ystart,
+                      unsigned int yend,
+                      uint32_t *fcount)
+{
+    uint16_t *hrows;
+    uint16_t *prev;
+    uint16_t *cur;
+    uint16_t *next;
+    uint16_t *tmp;
+    unsigned int ylast;
+    unsigned int yloop;
+    unsigned int xloop;
+    unsigned int lo;
+    unsigned int hi;
+    unsigned int achain[4];
+    unsigned int bchain[4];
+    unsigned int acount;
+    unsigned int bcount;
+    bitmap_span *cover;
+    unsigned int ccount;
+    unsigned int cloop;
+    uint32_t count = 0;
+
+    hrows = malloc(3 * (bm->width + 2) * sizeof(uint16_t));
+    if (hrows == NULL) {
+        return false;
+    }
+    cover = malloc(GEN_COVER_MAX(bm) * sizeof(bitmap_span));
+    if (cover == NULL) {
+        free(hrows);
+        return false;
+    }
+    prev = hrows;
+    cur = prev + bm->width + 2;
+    next = cur + bm->width + 2;
+
+    mesh_gen_column_row(bm, options, (int)ystart - 1, prev);
+    mesh_gen_column_row(bm, options, ystart, cur);
+
+    ylast = (yend == bm->height) ? yend + 1 : yend;
+
+    for (yloop = ystart; yloop < ylast; yloop++) {
+        mesh_gen_column_row(bm, options, yloop + 1, next);
+
+        /* front face and cap of each column */
+        ccount = mesh_gen_span_cover(bm, yloop, yloop, 0, bm->width, cover);
+        for (cloop = 0; cloop < ccount; cloop++) {
+            for (xloop = cover[cloop].start; xloop < cover[cloop].end; xloop++) {
+                count += 4;
+                if (mesh == NULL) {
+                    continue;
+                }
+                mesh->cubes++;
+                if (!options->merge) {
+                    mesh_gen_case(mesh, &gen_cube_cases[FACE_FRONT | FACE_BACK],
+                                  xloop, -(float)yloop, 0,
+                                  1, 1, cur[xloop + 1]);
+                }
+            }
+        }
+
+        /* walls on the left edge of each column and the right image edge,
+         * only the edges of the runs of the row can have walls
+         */
+        ccount = mesh_gen_span_cover(bm, yloop, yloop, 1, bm->width + 1, cover);
+        for (cloop = 0; cloop < ccount; cloop++) {
+            for (xloop = cover[cloop].start; xloop < cover[cloop].end; xloop++) {
+                if (cur[xloop] == cur[xloop + 1]) {
+                    continue;
+                }
+                lo = (cur[xloop] < cur[xloop + 1]) ? cur[xloop] : cur[xloop + 1];
+                hi = cur[xloop] + cur[xloop + 1] - lo;
+
+                acount = mesh_gen_wall_chain(lo, hi, prev[xloop], prev[xloop + 1], achain);
+                bcount = mesh_gen_wall_chain(lo, hi, next[xloop], next[xloop + 1], bchain);
+                count += mesh_gen_wall(mesh,
+                                       xloop, -(float)yloop + 1, achain, acount,
+                                       xloop, -(float)yloop, bchain, bcount,
+                                       (cur[xloop + 1] > cur[xloop]) ? -1 : 1, 0);
+            }
+        }
+
+        /* walls on the top edge of each column, only the runs of the row and
+         * the row above can have walls
+         */
+        ccount = mesh_gen_span_cover(bm, (int)yloop - 1, yloop, 0, bm->width, cover);
+        for (cloop = 0; cloop < ccount; cloop++) {
+            for (xloop = cover[cloop].start; xloop < cover[cloop].end; xloop++) {
+                if (prev[xloop + 1] == cur[xloop + 1]) {
+                    continue;
+                }
+                lo = (prev[xloop + 1] < cur[xloop + 1]) ? prev[xloop + 1] : cur[xloop + 1];
+                hi = prev[xloop + 1] + cur[xloop + 1] - lo;
+
+                acount = mesh_gen_wall_chain(lo, hi, prev[xloop], cur[xloop], achain);
+                bcount = mesh_gen_wall_chain(lo, hi, prev[xloop + 2], cur[xloop + 2], bchain);
+                count += mesh_gen_wall(mesh,
+                                       xloop, -(float)yloop + 1, achain, acount,
+                                       xloop + 1, -(float)yloop + 1, bchain, bcount,
+                                       0, (cur[xloop + 1] > prev[xloop + 1]) ? 1 : -1);
+            }
+        }
+
+        tmp = prev;
+        prev = cur;
+        cur = next;
+        next = tmp;
+    }
+
+    free(cover);
+    free(hrows);
+
+    *fcount += count;
+
+    return true;
+}
+
+/* generate height field cubic mesh
+ *
+ * The multi level cube finish is a height field so rather than considering
+ * every voxel each pixel is quantised into a column once and the column is
+ * covered with a cap and the walls its neighbours leave exposed. The cost
+ * is independent of the number of levels.
+ */
+static bool
+mesh_gen_columns_rows(struct mesh *mesh,
+                      bitmap *bm,
+                      options *options,
+                      unsigned int ystart,
+                      unsigned int yend,
+                      uint8_t *frow)
+{
+    uint32_t fcount = 0;
+
+    return mesh_gen_columns_band(mesh, bm, options, ystart, yend, &fcount);
+}
+
+/** count the facets the height field generator adds for a range of rows */
+static uint32_t
+mesh_gen_columns_count(bitmap *bm,
+                       options *options,
+                       unsigned int ystart,
+                       unsigned int yend,
+                       uint8_t *frow)
+{
+    uint32_t fcount = 0;
+
+    if (!mesh_gen_columns_band(NULL, bm, options, ystart, yend, &fcount)) {
+        return 0;
+    }
+
+    return fcount;
+}
+
+/** Shape of a terrace slab location covered by the whole unit square */
+#define TERRACE_SQUARE 0x10
+
+/** Most heights on the vertical edge at a terrace corner
+ *
+ * Each of the four locations at a corner changes shape at most at its own
+ * height and the heights of its four neighbours, plus the two wall ends.
+ */
+#define TERRACE_CHAIN_MAX 24
+
+/** a location of the terrace finish and the heights around it */
+struct gen_terrace {
+    unsigned int h; /**< number of levels the location fills */
+    unsigned int side[4]; /**< neighbour heights, left, right, top, bottom */
+};
+
+/** shape of a terrace location within one level
+ *
+ * The sides whose neighbours do not reach the level are exposed and the
+ * marching squares diagonal cuts the corner between exactly two adjacent
+ * exposed sides, just as the single level smooth finish does.
+ *
+ * @return Zero if the location is empty, TERRACE_SQUARE if it is whole or
+ *         the exposed sides of a location cut to a triangle.
+ */
+static inline unsigned int
+mesh_gen_terrace_shape(const struct gen_terrace *t, unsigned int z)
+{
+    unsigned int sides = 0;
+
+    if (z >= t->h) {
+        return 0;
+    }
+
+    if (t->side[0] <= z) {
+        sides |= FACE_LEFT;
+    }
+    if (t->side[1] <= z) {
+        sides |= FACE_RIGHT;
+    }
+    if (t->side[2] <= z) {
+        sides |= FACE_TOP;
+    }
+    if (t->side[3] <= z) {
+        sides |= FACE_BOT;
+    }
+
+    if (mesh_gen_square_faces(sides | FACE_FRONT, true) == 0) {
+        return sides;
+    }
+    return TERRACE_SQUARE;
+}
+
+/** area of one terrace shape not covered by another
+ *
+ * A triangle and its complement share the same diagonal so the part of a
+ * square outside a triangle is the triangle with the opposite sides exposed.
+ * Exposed sides only accumulate going up so a location never changes from
+ * one triangle to another.
+ */
+static inline unsigned int
+mesh_gen_terrace_less(unsigned int a, unsigned int b)
+{
+    if ((a == b) || (a == 0)) {
+        return 0;
+    }
+    if (b == 0) {
+        return a;
+    }
+    if (a == TERRACE_SQUARE) {
+        return b ^ 0xf;
+    }
+    return 0;
+}
+
+/** read a terrace location from the rolling column height rows
+ *
+ * @param rows The padded height rows, the location is on the middle row.
+ * @param x The location on the row.
+ */
+static inline void
+mesh_gen_terrace_at(uint16_t * const *rows, unsigned int x, struct gen_terrace *t)
+{
+    t->h = rows[1][x + 1];
+    t->side[0] = rows[1][x];
+    t->side[1] = rows[1][x + 2];
+    t->side[2] = rows[0][x + 1];
+    t->side[3] = rows[2][x + 1];
+}
+
+/** levels at which the shape of a terrace location changes
+ *
+ * @param events Array of at least five entries filled with the levels in
+ *               ascending order, the last is always the location height.
+ * @return The number of levels.
+ */
+static unsigned int
+mesh_gen_terrace_events(const struct gen_terrace *t, unsigned int *events)
+{
+    unsigned int count = 0;
+    unsigned int sloop;
+    unsigned int eloop;
+    unsigned int z;
+
+    for (sloop = 0; sloop < 4; sloop++) {
+        z = t->side[sloop];
+        if ((z == 0) || (z >= t->h) ||
+            (mesh_gen_terrace_shape(t, z - 1) == mesh_gen_terrace_shape(t, z))) {
+            continue;
+        }
+        /* insertion sort, ignoring duplicates */
+        for (eloop = count; (eloop > 0) && (events[eloop - 1] > z); eloop--) {
+        }
+        if ((eloop > 0) && (events[eloop - 1] == z)) {
+            continue;
+        }
+        memmove(events + eloop + 1, events + eloop,
+                (count - eloop) * sizeof(unsigned int));
+        events[eloop] = z;
+        count++;
+    }
+    events[count++] = t->h;
+
+    return count;
+}
+
+/** levels at which a terrace location is cut to a triangle
+ *
+ * A location is a triangle for at most one run of levels as its exposed
+ * sides only accumulate going up.
+ *
+ * @return The exposed sides of the triangle or zero if it is never cut.
+ */
+static unsigned int
+mesh_gen_terrace_triangle(const struct gen_terrace *t,
+                          unsigned int *lo,
+                          unsigned int *hi)
+{
+    unsigned int events[5];
+    unsigned int count;
+    unsigned int eloop;
+    unsigned int shape;
+    unsigned int z = 0;
+
+    count = mesh_gen_terrace_events(t, events);
+    for (eloop = 0; eloop < count; eloop++) {
+        shape = mesh_gen_terrace_shape(t, z);
+        if ((shape != 0) && (shape != TERRACE_SQUARE)) {
+            *lo = z;
+            *hi = events[eloop];
+            return shape;
+        }
+        z = events[eloop];
+    }
+
+    return 0;
+}
+
+/** heights of the vertices on the vertical edge at a terrace corner
+ *
+ * The edge has a vertex at every level where one of the four locations
+ * around the corner changes shape, which includes the ends of every wall
+ * and cap meeting there, so walls sharing the edge match each other and the
+ * caps without T junctions.
+ *
+ * @param rows The padded height rows from two rows above the corner up to
+ *             the row below it.
+ * @param x The corner on the lattice row.
+ * @param lo The bottom of the wall.
+ * @param hi The top of the wall.
+ * @param chain Array of TERRACE_CHAIN_MAX entries filled with the heights.
+ * @return The number of heights in the chain.
+ */
+static unsigned int
+mesh_gen_terrace_chain(uint16_t * const *rows,
+                       unsigned int x,
+                       unsigned int lo,
+                       unsigned int hi,
+                       unsigned int *chain)
+{
+    struct gen_terrace t;
+    unsigned int events[5];
+    unsigned int ecount;
+    unsigned int eloop;
+    unsigned int loc;
+    unsigned int count = 0;
+    unsigned int cloop;
+    unsigned int z;
+
+    chain[count++] = lo;
+    for (loc = 0; loc < 4; loc++) {
+        /* the locations above left, above, left and at the corner, the
+         * padding either side of the rows is empty
+         */
+        if (rows[(loc >> 1) + 1][x + (loc & 1)] == 0) {
+            continue;
+        }
+        mesh_gen_terrace_at(rows + (loc >> 1), x - 1 + (loc & 1), &t);
+        ecount = mesh_gen_terrace_events(&t, events);
+        for (eloop = 0; eloop < ecount; eloop++) {
+            z = events[eloop];
+            if ((z <= lo) || (z >= hi)) {
+                continue;
+            }
+            for (cloop = count; chain[cloop - 1] > z; cloop--) {
+            }
+            if (chain[cloop - 1] == z) {
+                continue;
+            }
+            memmove(chain + cloop + 1, chain + cloop,
+                    (count - cloop) * sizeof(unsigned int));
+            chain[cloop] = z;
+            count++;
+        }
+    }
+    chain[count++] = hi;
+
+    return count;
+}
+
+/** add the cap of a terrace location at a level
+ *
+ * @param shape The area of the location covered by the cap.
+ * @param up The cap faces up, otherwise it faces down.
+ * @return The number of facets in the cap.
+ */
+static uint32_t
+mesh_gen_terrace_cap(struct mesh *mesh,
+                     unsigned int shape,
+                     unsigned int x,
+                     unsigned int y,
+                     unsigned int z,
+                     bool up)
+{
+    const uint8_t *c;
+    float base = up ? (float)z - 1 : z;
+
+    if (shape == 0) {
+        return 0;
+    }
+    if (shape == TERRACE_SQUARE) {
+        if (mesh != NULL) {
+            mesh_gen_case_unit(mesh,
+                               &gen_cube_cases[up ? FACE_BACK : FACE_FRONT],
+                               x, -(float)y, base);
+        }
+        return 2;
+    }
+
+    if (mesh != NULL) {
+        c = gen_diagonal_facets[shape][up ? 3 : 2];
+        mesh_add_facet(mesh,
+                       x + (c[0] & 1), -(float)y + ((c[0] >> 1) & 1), base + (c[0] >> 2),
+                       x + (c[1] & 1), -(float)y + ((c[1] >> 1) & 1), base + (c[1] >> 2),
+                       x + (c[2] & 1), -(float)y + ((c[2] >> 1) & 1), base + (c[2] >> 2));
+    }
+    return 1;
+}
+
+/** add a terrace wall between two corners
+ *
+ * @param arows The height rows of the corner at one end of the wall.
+ * @param ax The corner at one end of the wall.
+ * @param brows The height rows of the corner at the other end of the wall.
+ * @param bx The corner at the other end of the wall.
+ * @return The number of facets in the wall.
+ */
+static uint32_t
+mesh_gen_terrace_wall(struct mesh *mesh,
+                      unsigned int lo,
+                      unsigned int hi,
+                      uint16_t * const *arows, unsigned int ax, float ay,
+                      uint16_t * const *brows, unsigned int bx, float by,
+                      float nx, float ny)
+{
+    unsigned int achain[TERRACE_CHAIN_MAX];
+    unsigned int bchain[TERRACE_CHAIN_MAX];
+    unsigned int acount;
+    unsigned int bcount;
+
+    acount = mesh_gen_terrace_chain(arows, ax, lo, hi, achain);
+    bcount = mesh_gen_terrace_chain(brows, bx, lo, hi, bchain);
+
+    return mesh_gen_wall(mesh,
+                         ax, ay, achain, acount,
+                         bx, by, bchain, bcount,
+                         nx, ny);
+}
+
+/** add the walls along one edge of a terrace location
+ *
+ * The owner location is solid and the other empty from the lower height
+ * up to the owner height, except where the owner is cut to a triangle
+ * which leaves the edge to the diagonal.
+ *
+ * @param lo The height of the location on the other side of the edge.
+ * @return The number of facets in the walls.
+ */
+static uint32_t
+mesh_gen_terrace_edge(struct mesh *mesh,
+                      const struct gen_terrace *owner,
+                      unsigned int lo,
+                      uint16_t * const *arows, unsigned int ax, float ay,
+                      uint16_t * const *brows, unsigned int bx, float by,
+                      float nx, float ny)
+{
+    unsigned int tlo;
+    unsigned int thi;
+    uint32_t count = 0;
+
+    if ((mesh_gen_terrace_triangle(owner, &tlo, &thi) == 0) ||
+        (thi <= lo)) {
+        return mesh_gen_terrace_wall(mesh, lo, owner->h,
+                                     arows, ax, ay, brows, bx, by, nx, ny);
+    }
+
+    if (tlo > lo) {
+        count += mesh_gen_terrace_wall(mesh, lo, tlo,
+                                       arows, ax, ay, brows, bx, by, nx, ny);
+    }
+    if (thi < owner->h) {
+        count += mesh_gen_terrace_wall(mesh, (thi > lo) ? thi : lo, owner->h,
+                                       arows, ax, ay, brows, bx, by, nx, ny);
+    }
+
+    return count;
+}
+
+/** generate or count the terraces of a range of rows
+ *
+ * Each level is a slab shaped by the marching squares contour of the
+ * locations reaching it. Every location has caps only at the levels where
+ * its shape changes, the part of the shape below not covered above facing
+ * up and the part above overhanging the shape below facing down. Walls
+ * follow the contours and span every level over which the contour is
+ * unchanged. The heights are kept for the two rows either side of the row
+ * so the shapes around both corners of a wall are known.
+ *
+ * @param mesh The mesh to add the facets to or NULL to only count them.
+ * @param fcount Updated with the number of facets.
+ */
+static bool
+mesh_gen_terrace_band(struct mesh *mesh,
+                      bitmap *bm,
+                      options *options,
+                      unsigned int ystart,
+                      unsigned int yend,
+                      uint32_t *fcount)
+{
+    uint16_t *hrows;
+    uint16_t *rows[5];
+    uint16_t *tmp;
+    struct gen_terrace t;
+    struct gen_terrace n;
+    unsigned int events[5];
+    unsigned int ecount;
+    unsigned int eloop;
+    unsigned int shape;
+    unsigned int below;
+    unsigned int tlo;
+    unsigned int thi;
+    unsigned int ylast;
+    unsigned int yloop;
+    unsigned int xloop;
+    unsigned int rloop;
+    bitmap_span *cover;
+    unsigned int ccount;
+    unsigned int cloop;
+    uint32_t count = 0;
+
+    hrows = malloc(5 * (bm->width + 2) * sizeof(uint16_t));
+    if (hrows == NULL) {
+        return false;
+    }
+    cover = malloc(GEN_COVER_MAX(bm) * sizeof(bitmap_span));
+    if (cover == NULL) {
+        free(hrows);
+        return false;
+    }
+    for (rloop = 0; rloop < 5; rloop++) {
+        rows[rloop] = hrows + (rloop * (bm->width + 2));
+    }
+
+    /* rows[2] is the row being generated */
+    for (rloop = 0; rloop < 4; rloop++) {
+        mesh_gen_column_row(bm, options, (int)ystart - 2 + rloop, rows[rloop + 1]);
+    }
+
+    ylast = (yend == bm->height) ? yend + 1 : yend;
+
+    for (yloop = ystart; yloop < ylast; yloop++) {
+        tmp = rows[0];
+        memmove(rows, rows + 1, 4 * sizeof(uint16_t *));
+        rows[4] = tmp;
+        mesh_gen_column_row(bm, options, yloop + 2, rows[4]);
+
+        /* caps and diagonal walls of each location */
+        ccount = mesh_gen_span_cover(bm, yloop, yloop, 0, bm->width, cover);
+        for (cloop = 0; cloop < ccount; cloop++) {
+            for (xloop = cover[cloop].start; xloop < cover[cloop].end; xloop++) {
+                mesh_gen_terrace_at(rows + 1, xloop, &t);
+                if (t.h == 0) {
+                    continue;
+                }
+                if (mesh != NULL) {
+                    mesh->cubes++;
+                }
+
+                below = mesh_gen_terrace_shape(&t, 0);
+                count += mesh_gen_terrace_cap(mesh, below, xloop, yloop, 0, false);
+                ecount = mesh_gen_terrace_events(&t, events);
+                for (eloop = 0; eloop < ecount; eloop++) {
+                    shape = mesh_gen_terrace_shape(&t, events[eloop]);
+                    count += mesh_gen_terrace_cap(mesh,
+                                                  mesh_gen_terrace_less(below, shape),
+                                                  xloop, yloop, events[eloop], true);
+                    count += mesh_gen_terrace_cap(mesh,
+                                                  mesh_gen_terrace_less(shape, below),
+                                                  xloop, yloop, events[eloop], false);
+                    below = shape;
+                }
+
+                switch (mesh_gen_terrace_triangle(&t, &tlo, &thi)) {
+                case FACE_TOP | FACE_LEFT:
+                    count += mesh_gen_terrace_wall(mesh, tlo, thi,
+                                                   rows, xloop + 1, -(float)yloop + 1,
+                                                   rows + 1, xloop, -(float)yloop,
+                                                   -1, 1);
+                    break;
+
+                case FACE_TOP | FACE_RIGHT:
+                    count += mesh_gen_terrace_wall(mesh, tlo, thi,
+                                                   rows, xloop, -(float)yloop + 1,
+                                                   rows + 1, xloop + 1, -(float)yloop,
+                                                   1, 1);
+                    break;
+
+                case FACE_BOT | FACE_LEFT:
+                    count += mesh_gen_terrace_wall(mesh, tlo, thi,
+                                                   rows, xloop, -(float)yloop + 1,
+                                                   rows + 1, xloop + 1, -(float)yloop,
+                                                   -1, -1);
+                    break;
+
+                case FACE_BOT | FACE_RIGHT:
+                    count += mesh_gen_terrace_wall(mesh, tlo, thi,
+                                                   rows, xloop + 1, -(float)yloop + 1,
+                                                   rows + 1, xloop, -(float)yloop,
+                                                   1, -1);
+                    break;
+                }
+            }
+        }
+
+        /* walls on the left edge of each location and the right image edge */
+        ccount = mesh_gen_span_cover(bm, yloop, yloop, 1, bm->width + 1, cover);
+        for (cloop = 0; cloop < ccount; cloop++) {
+            for (xloop = cover[cloop].start; xloop < cover[cloop].end; xloop++) {
+                if (rows[2][xloop] == rows[2][xloop + 1]) {
+                    continue;
+                }
+                if (rows[2][xloop + 1] > rows[2][xloop]) {
+                    mesh_gen_terrace_at(rows + 1, xloop, &t);
+                } else {
+                    mesh_gen_terrace_at(rows + 1, xloop - 1, &t);
+                }
+                count += mesh_gen_terrace_edge(mesh, &t,
+                                               rows[2][xloop] + rows[2][xloop + 1] - t.h,
+                                               rows, xloop, -(float)yloop + 1,
+                                               rows + 1, xloop, -(float)yloop,
+                                               (rows[2][xloop + 1] > rows[2][xloop]) ? -1 : 1, 0);
+            }
+        }
+
+        /* walls on the top edge of each location */
+        ccount = mesh_gen_span_cover(bm, (int)yloop - 1, yloop, 0, bm->width, cover);
+        for (cloop = 0; cloop < ccount; cloop++) {
+            for (xloop = cover[cloop].start; xloop < cover[cloop].end; xloop++) {
+                if (rows[1][xloop + 1] == rows[2][xloop + 1]) {
+                    continue;
+                }
+                if (rows[2][xloop + 1] > rows[1][xloop + 1]) {
+                    mesh_gen_terrace_at(rows + 1, xloop, &t);
+                    mesh_gen_terrace_at(rows, xloop, &n);
+                } else {
+                    mesh_gen_terrace_at(rows, xloop, &t);
+                    mesh_gen_terrace_at(rows + 1, xloop, &n);
+                }
+                count += mesh_gen_terrace_edge(mesh, &t, n.h,
+                                               rows, xloop, -(float)yloop + 1,
+                                               rows, xloop + 1, -(float)yloop + 1,
+                                               0, (rows[2][xloop + 1] > rows[1][xloop + 1]) ? 1 : -1);
+            }
+        }
+    }
+
+    free(cover);
+    free(hrows);
+
+    *fcount += count;
+
+    return true;
+}
+
+/* generate terraced marching squares mesh
+ *
+ * The multi level smooth terrace finish keeps the flat levels of the cube
+ * finish with the sloped outline of the single level smooth finish.
+ */
+static bool
+mesh_gen_terrace_rows(struct mesh *mesh,
+                      bitmap *bm,
+                      options *options,
+                      unsigned int ystart,
+                      unsigned int yend,
+                      uint8_t *frow)
+{
+    uint32_t fcount = 0;
+
+    return mesh_gen_terrace_band(mesh, bm, options, ystart, yend, &fcount);
+}
+
+/** count the facets the terrace generator adds for a range of rows */
+static uint32_t
+mesh_gen_terrace_count(bitmap *bm,
+                       options *options,
+                       unsigned int ystart,
+                       unsigned int yend,
+                       uint8_t *frow)
+{
+    uint32_t fcount = 0;
+
+    if (!mesh_gen_terrace_band(NULL, bm, options, ystart, yend, &fcount)) {
+        return 0;
+    }
+
+    return fcount;
+}
+
+/** add the marching cubes facets of a cell
+ *
+ * @param x The x location of the cell origin.
+ * @param y The y location of the cell origin.
+ * @param z The z location of the cell origin.
+ */
+static inline void
+mesh_gen_cell(struct mesh *mesh,
+              const struct gen_cell_case *ccase,
+              float x, float y, float z)
+{
+    unsigned int floop;
+    const uint8_t *v;
+
+    for (floop = 0; floop < ccase->count; floop++) {
+        v = ccase->vertex[floop];
+        mesh_add_facet(mesh,
+                       x + ((v[0] & 3) * 0.5f),
+                       y + (((v[0] >> 2) & 3) * 0.5f),
+                       z + ((v[0] >> 4) * 0.5f),
+                       x + ((v[1] & 3) * 0.5f),
+                       y + (((v[1] >> 2) & 3) * 0.5f),
+                       z + ((v[1] >> 4) * 0.5f),
+                       x + ((v[2] & 3) * 0.5f),
+                       y + (((v[2] >> 2) & 3) * 0.5f),
+                       z + ((v[2] >> 4) * 0.5f));
+    }
+}
+
+/** marching cubes case of a cell from the four column heights about it
+ *
+ * The cell spans the voxel layers z - 1 and z, voxels below the base are
+ * empty.
+ *
+ * @param h The column heights at the cell corners indexed by x | y << 1.
+ */
+static inline unsigned int
+mesh_gen_cell_index(const unsigned int *h, unsigned int z)
+{
+    unsigned int cells = 0;
+    unsigned int cloop;
+
+    for (cloop = 0; cloop < 4; cloop++) {
+        if ((z > 0) && ((z - 1) < h[cloop])) {
+            cells |= 1 << cloop;
+        }
+        if (z < h[cloop]) {
+            cells |= 1 << (cloop | 4);
+        }
+    }
+
+    return cells;
+}
+
+/** generate or count the marching cubes cells of a range of rows
+ *
+ * The cells lie between the voxel centres so cell row y joins pixel rows
+ * y - 1 and y and the final row closes the bottom of the image. The voxels
+ * of each pixel form a column so only the base cell and the cells between
+ * the lowest and highest of the four columns about a cell column are
+ * neither wholly solid nor wholly empty.
+ *
+ * @param mesh The mesh to add the facets to or NULL to only count them.
+ * @param fcount Updated with the number of facets.
+ */
+static bool
+mesh_gen_cells_band(struct mesh *mesh,
+                    bitmap *bm,
+                    options *options,
+                    unsigned int ystart,
+                    unsigned int yend,
+                    uint32_t *fcount)
+{
+    uint16_t *hrows;
+    uint16_t *prev;
+    uint16_t *cur;
+    uint16_t *tmp;
+    unsigned int yloop;
+    unsigned int xloop;
+    unsigned int zloop;
+    unsigned int h[4];
+    unsigned int lo;
+    unsigned int hi;
+    const struct gen_cell_case *ccase;
+    bitmap_span *cover;
+    unsigned int ccount;
+    unsigned int cloop;
+    uint32_t count = 0;
+
+    hrows = malloc(2 * (bm->width + 2) * sizeof(uint16_t));
+    if (hrows == NULL) {
+        return false;
+    }
+    cover = malloc(GEN_COVER_MAX(bm) * sizeof(bitmap_span));
+    if (cover == NULL) {
+        free(hrows);
+        return false;
+    }
+    prev = hrows;
+    cur = prev + bm->width + 2;
+
+    mesh_gen_column_row(bm, options, (int)ystart - 1, prev);
+
+    for (yloop = ystart; yloop < yend; yloop++) {
+        mesh_gen_column_row(bm, options, yloop, cur);
+
+        /* only lattice locations touching the runs of the row or the row
+         * above have solid cell corners
+         */
+        ccount = mesh_gen_span_cover(bm, (int)yloop - 1, yloop, 1, bm->width + 1, cover);
+        for (cloop = 0; cloop < ccount; cloop++) {
+            for (xloop = cover[cloop].start; xloop < cover[cloop].end; xloop++) {
+                h[0] = cur[xloop];
+                h[1] = cur[xloop + 1];
+                h[2] = prev[xloop];
+                h[3] = prev[xloop + 1];
+
+                lo = h[0];
+                hi = h[0];
+                for (zloop = 1; zloop < 4; zloop++) {
+                    lo = (h[zloop] < lo) ? h[zloop] : lo;
+                    hi = (h[zloop] > hi) ? h[zloop] : hi;
+                }
+                if (hi == 0) {
+                    continue;
+                }
+
+                for (zloop = 0; zloop <= hi; zloop++) {
+                    /* skip the wholly solid cells above the base cell */
+                    if ((zloop > 0) && (zloop < lo)) {
+                        zloop = lo;
+                    }
+                    ccase = &gen_cell_cases[mesh_gen_cell_index(h, zloop)];
+                    count += ccase->count;
+                    if ((mesh != NULL) && (ccase->count > 0)) {
+                        mesh->cubes++;
+                        mesh_gen_cell(mesh, ccase,
+                                      xloop - 0.5f,
+                                      0.5f - yloop,
+                                      zloop - 0.5f);
+                    }
+                }
+            }
+        }
+
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    free(cover);
+    free(hrows);
+
+    *fcount += count;
+
+    return true;
+}
+
+/* generate marching cubes
+ *
+ * The multi level smooth finish applies marching cubes to the voxels of
+ * every level http://en.wikipedia.org/wiki/Marching_cubes giving sloped
+ * sides between the levels as well as around the outline. The vertices lie
+ * midway between voxel centres so are not on the integer lattice.
+ */
+static bool
+mesh_gen_cells_rows(struct mesh *mesh,
+                    bitmap *bm,
+                    options *options,
+                    unsigned int ystart,
+                    unsigned int yend,
+                    uint8_t *frow)
+{
+    uint32_t fcount = 0;
+
+    return mesh_gen_cells_band(mesh, bm, options, ystart, yend, &fcount);
+}
+
+/** count the facets the marching cubes generator adds for a range of rows */
+static uint32_t
+mesh_gen_cells_count(bitmap *bm,
+                     options *options,
+                     unsigned int ystart,
+                     unsigned int yend,
+                     uint8_t *frow)
+{
+    uint32_t fcount = 0;
+
+    if (!mesh_gen_cells_band(NULL, bm, options, ystart, yend, &fcount)) {
+        return 0;
+    }
+
+    return fcount;
+}
+
+static inline float 
+surfacegen_calcp(bitmap *bm,
+                 int x, 
+                 int y,
+                 options *options)
+{
+    uint8_t pxl_val;
+    int res;
+
+    /* range check, casts are safe because value cannot be -ve from previous
+     * test.
+     */
+    if ((x < 0) || ((unsigned int)x >= bm->width) || 
+        (y < 0) || ((unsigned int)y >= bm->height)) {
+        return 0.0f;
+    }
+        
+    pxl_val = bm->data[(y * bm->width) + x];
+
+    if (pxl_val == options->transparent) {
+        return 0.0f;
+    } 
+
+    res = 1+(pxl_val + 1) / (256 / options->levels);
+
+    return res;
+}
+
+#define ADDSF(xa,ya,za,xb,yb,zb,xc,yc,zc) mesh_add_facet(mesh,           \
+        x + (xa * width), y + (ya * height), za * points[xa][ya],          \
+        x + (xb * width), y + (yb * height), zb * points[xb][yb],          \
+        x + (xc * width), y + (yc * height), zc * points[xc][yc])
+
+static void
+gen_surface(struct mesh *mesh,
+                 float x, float y, 
+                 float width, float height, 
+                 bool evenp, float points[2][2])
+{
+    if (evenp) {
+        if ( (points[0][0] != 0) || 
+             (points[1][1] != 0) || 
+             (points[0][1] != 0)) {
+            /* top surface */
+            ADDSF(0,0,1, 0,1,1, 1,1,1);
+
+            /* flat bottom */
+            ADDSF(0,0,0, 1,1,0, 0,1,0);
+        }
+
+        if ( (points[0][0] != 0) || 
+             (points[1][0] != 0) || 
+             (points[1][1] != 0)) {
+
+            /* top surface */
+            ADDSF(0,0,1, 1,1,1, 1,0,1);
+
+            /* flat bottom */
+            ADDSF(0,0,0, 1,0,0, 1,1,0);
+        }
+
+    } else {
+        if ( (points[0][0] != 0) || 
+             (points[1][0] != 0) || 
+             (points[0][1] != 0)) {
+
+            /* top surface */
+            ADDSF(0,0,1, 0,1,1, 1,0,1);
+
+            /* flat bottom */
+            ADDSF(0,0,0, 1,0,0, 0,1,0);
+        }
+
+        if ( (points[1][0] != 0) || 
+             (points[1][1] != 0) || 
+             (points[0][1] != 0)) {
+            /* top surface */
+            ADDSF(1,0,1, 0,1,1, 1,1,1);
+
+            /* flat bottom */
+            ADDSF(1,0,0, 1,1,0, 0,1,0);
+        }
+    }
+}
+
+
+/** count the facets gen_surface() adds for a location */
+static inline uint32_t
+gen_surface_count(bool evenp, float points[2][2])
+{
+    uint32_t fcount = 0;
+
+    if (evenp) {
+        if ((points[0][0] != 0) || (points[1][1] != 0) || (points[0][1] != 0)) {
+            fcount += 2;
+        }
+        if ((points[0][0] != 0) || (points[1][0] != 0) || (points[1][1] != 0)) {
+            fcount += 2;
+        }
+    } else {
+        if ((points[0][0] != 0) || (points[1][0] != 0) || (points[0][1] != 0)) {
+            fcount += 2;
+        }
+        if ((points[1][0] != 0) || (points[1][1] != 0) || (points[0][1] != 0)) {
+            fcount += 2;
+        }
+    }
+
+    return fcount;
+}
+
+/** quantise a row of surface samples
+ *
+ * Entry n of the row holds the height of the pixel left of lattice location
+ * n so the row is two entries wider than the bitmap.
+ */
+static void
+surfacegen_calcrow(bitmap *bm, int y, options *options, float *heights)
+{
+    unsigned int xloop;
+
+    for (xloop = 0; xloop < (bm->width + 2); xloop++) {
+        heights[xloop] = surfacegen_calcp(bm, xloop - 1, y, options);
+    }
+}
+
+/* generate or count the heightmap surface of a range of rows
+ *
+ * The surface has a row of vertices above and below every pixel so there is
+ * one more row than the bitmap height. Every sample is quantised once into
+ * a rolling pair of rows either side of the lattice row being generated.
+ *
+ * @param mesh The mesh to add the facets to or NULL to only count them.
+ * @param fcount Updated with the number of facets.
+ */
+static bool
+mesh_gen_surface_band(struct mesh *mesh,
+                      bitmap *bm,
+                      options *options,
+                      unsigned int ystart,
+                      unsigned int yend,
+                      uint32_t *fcount)
+{
+    unsigned int yloop;
+    unsigned int xloop;
+    float points[2][2];
+    float *hrows;
+    float *prev;
+    float *cur;
+    float *tmp;
+    bool evenp;
+    uint32_t count = 0;
+
+    hrows = malloc(2 * (bm->width + 2) * sizeof(float));
+    if (hrows == NULL) {
+        return false;
+    }
+    prev = hrows;
+    cur = prev + bm->width + 2;
+
+    surfacegen_calcrow(bm, (int)ystart - 1, options, prev);
+
+    for (yloop = ystart; yloop < yend; yloop++) {
+        surfacegen_calcrow(bm, yloop, options, cur);
+
+        for (xloop = 0; xloop <= bm->width; xloop++) {
+            points[0][0] = prev[xloop];
+            points[1][0] = prev[xloop + 1];
+            points[0][1] = cur[xloop];
+            points[1][1] = cur[xloop + 1];
+
+            evenp = (((xloop + yloop) & 1) == 0);
+
+            if (mesh == NULL) {
+                count += gen_surface_count(evenp, points);
+            } else {
+                gen_surface(mesh, xloop, -(float)yloop, 1, -1, evenp, points);
+            }
+        }
+
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    free(hrows);
+
+    *fcount += count;
+
+    return true;
+}
+
+static bool
+mesh_gen_surface_rows(struct mesh *mesh,
+                      bitmap *bm,
+                      options *options,
+                      unsigned int ystart,
+                      unsigned int yend,
+                      uint8_t *frow)
+{
+    uint32_t fcount = 0;
+
+    return mesh_gen_surface_band(mesh, bm, options, ystart, yend, &fcount);
+}
+
+/** count the facets the surface generator adds for a range of rows */
+static uint32_t
+mesh_gen_surface_count(bitmap *bm,
+                       options *options,
+                       unsigned int ystart,
+                       unsigned int yend,
+                       uint8_t *frow)
+{
+    uint32_t fcount = 0;
+
+    if (!mesh_gen_surface_band(NULL, bm, options, ystart, yend, &fcount)) {
+        return 0;
+    }
+
+    return fcount;
+}
+
+/** generate the facets of the rows from ystart up to but excluding yend
+ *
+ * The frow parameter is a bitmap width array for the row face masks.
+ */
+typedef bool (rowgenerator)(struct mesh *mesh,
+                            bitmap *bm,
+                            options *options,
+                            unsigned int ystart,
+                            unsigned int yend,
+                            uint8_t *frow);
+
+/** count the facets generated for the rows from ystart up to yend */
+typedef uint32_t (rowcounter)(bitmap *bm,
+                              options *options,
+                              unsigned int ystart,
+                              unsigned int yend,
+                              uint8_t *frow);
+
+/** Fewest rows given to each thread of the parallel generator */
+#define GEN_BAND_MIN_ROWS 16
+
+/** Rows given to each thread for every chunk of a streamed mesh */
+#define GEN_STREAM_ROWS 32
+
+/** Per thread context of the parallel generator
+ *
+ * Each thread generates a contiguous band of rows into its own mesh. The
+ * first band is generated directly into the destination mesh by the calling
+ * thread.
+ */
+struct gen_band {
+    struct mesh *mesh; /**< mesh the band facets are generated into */
+    struct mesh band; /**< private mesh of the other bands */
+    bitmap *bm;
+    options *options;
+    rowgenerator *rowgen;
+    rowcounter *rowcount;
+    unsigned int ystart; /**< first row of the band */
+    unsigned int yend; /**< row after the last row of the band */
+    bool ok; /**< the band was generated successfully */
+};
+
+static void *
+mesh_gen_band(void *ctx)
+{
+    struct gen_band *band = ctx;
+    uint32_t fcount;
+    uint8_t *frow;
+
+    band->ok = false;
+
+    frow = malloc(band->bm->width + 1);
+    if (frow == NULL) {
+        return NULL;
+    }
+
+    /* size the facet array for the band before generating it */
+    fcount = band->rowcount(band->bm, band->options,
+                            band->ystart, band->yend, frow);
+    if (mesh_gen_reserve(band->mesh, band->mesh->fcount + fcount)) {
+        band->ok = band->rowgen(band->mesh,
+                                band->bm,
+                                band->options,
+                                band->ystart,
+                                band->yend,
+                                frow);
+    }
+
+    free(frow);
+
+    return NULL;
+}
+
+/** generate rows in parallel bands
+ *
+ * The bands are appended to the mesh in row order once every thread has
+ * finished so the facets are identical to generating the rows serially.
+ */
+static bool
+mesh_gen_rows_parallel(struct mesh *mesh,
+                       bitmap *bm,
+                       options *options,
+                       rowgenerator *rowgen,
+                       rowcounter *rowcount,
+                       unsigned int ystart,
+                       unsigned int yend,
+                       unsigned int threads)
+{
+    unsigned int rows = yend - ystart;
+    struct gen_band *bands;
+    pthread_t *tids;
+    unsigned int tloop;
+    unsigned int started = 0;
+    uint32_t fcount;
+    bool ok = true;
+
+    bands = calloc(threads, sizeof(struct gen_band));
+    tids = malloc(threads * sizeof(pthread_t));
+    if ((bands == NULL) || (tids == NULL)) {
+        free(bands);
+        free(tids);
+        return false;
+    }
+
+    for (tloop = 0; tloop < threads; tloop++) {
+        bands[tloop].mesh = &bands[tloop].band;
+        bands[tloop].bm = bm;
+        bands[tloop].options = options;
+        bands[tloop].rowgen = rowgen;
+        bands[tloop].rowcount = rowcount;
+        bands[tloop].ystart = ystart + ((uint64_t)rows * tloop) / threads;
+        bands[tloop].yend = ystart + ((uint64_t)rows * (tloop + 1)) / threads;
+    }
+    bands[0].mesh = mesh;
+
+    /* the calling thread generates the first band */
+    for (tloop = 1; tloop < threads; tloop++) {
+        if (pthread_create(&tids[tloop], NULL, mesh_gen_band, &bands[tloop]) != 0) {
+            break;
+        }
+        started = tloop;
+    }
+    mesh_gen_band(&bands[0]);
+
+    for (tloop = 1; tloop <= started; tloop++) {
+        pthread_join(tids[tloop], NULL);
+    }
+    free(tids);
+
+    if (started != (threads - 1)) {
+        ok = false;
+    }
+
+    /* append the bands in order */
+    fcount = mesh->fcount;
+    for (tloop = 0; tloop <= started; tloop++) {
+        ok = ok && bands[tloop].ok;
+        if (tloop > 0) {
+            fcount += bands[tloop].band.fcount;
+        }
+    }
+
+    if (ok) {
+        ok = mesh_gen_reserve(mesh, fcount);
+    }
+
+    for (tloop = 1; tloop <= started; tloop++) {
+        if (ok) {
+            memcpy(mesh->f + mesh->fcount,
+                   bands[tloop].band.f,
+                   bands[tloop].band.fcount * sizeof(struct facet));
+            mesh->fcount += bands[tloop].band.fcount;
+            mesh->cubes += bands[tloop].band.cubes;
+        }
+        free(bands[tloop].band.f);
+    }
+    free(bands);
+
+    return ok;
+}
+
+/** generate the rows of a mesh from ystart up to but excluding yend
+ *
+ * When several threads are available and the mesh is not being indexed as
+ * it is generated the rows are split into bands generated in parallel.
+ */
+static bool
+mesh_gen_rows(struct mesh *mesh,
+              bitmap *bm,
+              options *options,
+              rowgenerator *rowgen,
+              rowcounter *rowcount,
+              unsigned int ystart,
+              unsigned int yend)
+{
+    unsigned int threads = options->threads;
+    unsigned int rows = yend - ystart;
+    struct gen_band band;
+
+    if (threads > (rows / GEN_BAND_MIN_ROWS)) {
+        threads = rows / GEN_BAND_MIN_ROWS;
+    }
+
+    if ((threads <= 1) || (mesh->gindex != NULL)) {
+        band.mesh = mesh;
+        band.bm = bm;
+        band.options = options;
+        band.rowgen = rowgen;
+        band.rowcount = rowcount;
+        band.ystart = ystart;
+        band.yend = yend;
+        mesh_gen_band(&band);
+        return band.ok;
+    }
+
+    INFO("Generating %d rows with %d threads\n", rows, threads);
+
+    return mesh_gen_rows_parallel(mesh, bm, options,
+                                  rowgen, rowcount, ystart, yend, threads);
+}
+
+/** Largest ratio of adaptive surface network locations to lattice locations */
+#define RTIN_PAD_MAX 16
+
+/** number of locations along each side of the adaptive surface network
+ *
+ * The surface lattice has a location beyond each edge of the bitmap and is
+ * padded to a square of 2^n + 1 locations.
+ */
+static unsigned int
+rtin_side(bitmap *bm)
+{
+    unsigned int size = 2;
+
+    while ((size - 1) < (bm->width + 1) || (size - 1) < (bm->height + 1)) {
+        size = ((size - 1) * 2) + 1;
+    }
+
+    return size;
+}
+
+/** surface finish is triangulated adaptively
+ *
+ * The network is a single square so an elongated bitmap would be padded
+ * with far more locations than its lattice, those use the grid instead.
+ */
+static bool
+mesh_gen_surface_adaptive_fits(bitmap *bm, options *options)
+{
+    uint64_t size;
+
+    if (options->tolerance < 0) {
+        return false;
+    }
+
+    size = rtin_side(bm);
+
+    return (size * size) <=
+           ((uint64_t)RTIN_PAD_MAX * (bm->width + 2) * (bm->height + 2));
+}
+
+/** select the row generator of a finish
+ *
+ * @return The number of rows the finish generates or zero if it is not
+ *         generated a row at a time.
+ */
+static unsigned int
+mesh_gen_row_finish(bitmap *bm,
+                    options *options,
+                    rowgenerator **rowgen,
+                    rowcounter **rowcount)
+{
+    switch (options->finish) {
+    case FINISH_SMOOTH:
+        if (options->levels > 1) {
+            *rowgen = mesh_gen_cells_rows;
+            *rowcount = mesh_gen_cells_count;
+            return bm->height + 1;
+        }
+        *rowgen = mesh_gen_squares_rows;
+        *rowcount = mesh_gen_squares_count;
+        return bm->height;
+
+    case FINISH_TERRACE:
+        if (options->levels > 1) {
+            *rowgen = mesh_gen_terrace_rows;
+            *rowcount = mesh_gen_terrace_count;
+        } else {
+            *rowgen = mesh_gen_squares_rows;
+            *rowcount = mesh_gen_squares_count;
+        }
+        return bm->height;
+
+    case FINISH_CUBE:
+        if (options->levels > 1) {
+            *rowgen = mesh_gen_columns_rows;
+            *rowcount = mesh_gen_columns_count;
+        } else {
+            *rowgen = mesh_gen_cubes_rows;
+            *rowcount = mesh_gen_cubes_count;
+        }
+        return bm->height;
+
+    case FINISH_SURFACE:
+        if (mesh_gen_surface_adaptive_fits(bm, options)) {
+            break;
+        }
+        *rowgen = mesh_gen_surface_rows;
+        *rowcount = mesh_gen_surface_count;
+        return bm->height + 1;
+
+    case FINISH_EXTRUDE:
+    case FINISH_RECT:
+        break;
+    }
+
+    return 0;
+}
+
+static bool mesh_gen_squares(struct mesh *mesh, bitmap *bm, options *options)
+{
+    rowgenerator *rowgen;
+    rowcounter *rowcount;
+    unsigned int rows;
+
+    rows = mesh_gen_row_finish(bm, options, &rowgen, &rowcount);
+    if (!mesh_gen_rows(mesh, bm, options, rowgen, rowcount, 0, rows)) {
+        return false;
+    }
+
+    if (options->merge && (options->levels == 1)) {
+        return mesh_gen_merge_planes(mesh, bm, options, true);
+    }
+
+    return true;
+}
+
+static bool mesh_gen_cubes(struct mesh *mesh, bitmap *bm, options *options)
+{
+    rowgenerator *rowgen;
+    rowcounter *rowcount;
+    unsigned int rows;
+
+    rows = mesh_gen_row_finish(bm, options, &rowgen, &rowcount);
+    if (!mesh_gen_rows(mesh, bm, options, rowgen, rowcount, 0, rows)) {
+        return false;
+    }
+
+    if (options->merge) {
+        return mesh_gen_merge_planes(mesh, bm, options, false);
+    }
+
+    return true;
+}
+
+/** a run of solid pixels on a row of an extruded outline */
+struct extrude_run {
+    unsigned int x0; /**< first solid pixel of the run */
+    unsigned int x1; /**< pixel after the last solid pixel of the run */
+    unsigned int top; /**< lattice row the rectangle of the run starts on */
+};
+
+/** find the runs of solid pixels on a row
+ *
+ * Rows outside the bitmap have no runs.
+ *
+ * @return The number of runs.
+ */
+static unsigned int
+extrude_row_runs(bitmap *bm, options *options, int y, struct extrude_run *runs)
+{
+    const bitmap_span *span;
+    unsigned int count;
+    unsigned int sloop;
+
+    span = mesh_gen_row_spans(bm, y, &count);
+    for (sloop = 0; sloop < count; sloop++) {
+        runs[sloop].x0 = span[sloop].start;
+        runs[sloop].x1 = span[sloop].end;
+        runs[sloop].top = UINT_MAX;
+    }
+
+    return count;
+}
+
+/** add the front and back caps of an extruded rectangle
+ *
+ * The points on the top and bottom edges of the rectangle are zipped
+ * together so every outline vertex and rectangle corner on those edges is
+ * a facet vertex.
+ *
+ * @param mesh The mesh to add the facets to or NULL to only count them.
+ * @return The number of facets in the caps.
+ */
+static uint32_t
+extrude_caps(struct mesh *mesh,
+             const unsigned int *top, unsigned int tcount, float ytop,
+             const unsigned int *bot, unsigned int bcount, float ybot)
+{
+    unsigned int tloop = 0;
+    unsigned int bloop = 0;
+
+    if (mesh == NULL) {
+        return 2 * ((tcount - 1) + (bcount - 1));
+    }
+
+    while (((tloop + 1) < tcount) || ((bloop + 1) < bcount)) {
+        if (((tloop + 1) == tcount) ||
+            (((bloop + 1) < bcount) && (bot[bloop + 1] <= top[tloop + 1]))) {
+            mesh_add_facet(mesh,
+                           bot[bloop], ybot, 1,
+                           bot[bloop + 1], ybot, 1,
+                           top[tloop], ytop, 1);
+            mesh_add_facet(mesh,
+                           bot[bloop], ybot, 0,
+                           top[tloop], ytop, 0,
+                           bot[bloop + 1], ybot, 0);
+            bloop++;
+        } else {
+            mesh_add_facet(mesh,
+                           top[tloop], ytop, 1,
+                           bot[bloop], ybot, 1,
+                           top[tloop + 1], ytop, 1);
+            mesh_add_facet(mesh,
+                           top[tloop], ytop, 0,
+                           top[tloop + 1], ytop, 0,
+                           bot[bloop], ybot, 0);
+            tloop++;
+        }
+    }
+
+    return 2 * ((tcount - 1) + (bcount - 1));
+}
+
+/** add a rectangular wall of the extrusion from a to b */
+static uint32_t
+extrude_wall(struct mesh *mesh,
+             float ax, float ay, float bx, float by,
+             float nx, float ny)
+{
+    if (mesh != NULL) {
+        mesh_gen_wall_facet(mesh, ax, ay, 0, bx, by, 0, bx, by, 1, nx, ny);
+        mesh_gen_wall_facet(mesh, ax, ay, 0, bx, by, 1, ax, ay, 1, nx, ny);
+    }
+    return 2;
+}
+
+/** add the walls along a lattice row between the rows of runs either side
+ *
+ * The solid rows above and below are swept together and a wall is added
+ * wherever exactly one of them is solid.
+ */
+static uint32_t
+extrude_row_walls(struct mesh *mesh,
+                  const struct extrude_run *above, unsigned int acount,
+                  const struct extrude_run *below, unsigned int bcount,
+                  float y)
+{
+    unsigned int aloop = 0;
+    unsigned int bloop = 0;
+    unsigned int ax;
+    unsigned int bx;
+    unsigned int x = 0;
+    unsigned int nx;
+    bool asolid = false;
+    bool bsolid = false;
+    uint32_t count = 0;
+
+    while ((aloop < acount) || (bloop < bcount)) {
+        ax = (aloop < acount) ?
+            (asolid ? above[aloop].x1 : above[aloop].x0) : UINT_MAX;
+        bx = (bloop < bcount) ?
+            (bsolid ? below[bloop].x1 : below[bloop].x0) : UINT_MAX;
+        nx = (ax < bx) ? ax : bx;
+
+        if (asolid != bsolid) {
+            count += extrude_wall(mesh, x, y, nx, y, 0, asolid ? -1 : 1);
+        }
+
+        if (ax == nx) {
+            aloop += asolid ? 1 : 0;
+            asolid = !asolid;
+        }
+        if (bx == nx) {
+            bloop += bsolid ? 1 : 0;
+            bsolid = !bsolid;
+        }
+        x = nx;
+    }
+
+    return count;
+}
+
+/** generate or count the extruded outline of a single level bitmap
+ *
+ * The solid region is swept a row at a time. Runs of solid pixels which
+ * are repeated exactly on following rows stack into a rectangle, which is
+ * closed when the run changes. The horizontal edges of each rectangle hold
+ * the run ends of the neighbouring rows so the caps meet without T
+ * junctions and the vertical edges always lie on the outline, so the
+ * facets scale with the length of the outline rather than its area.
+ *
+ * @param mesh The mesh to add the facets to or NULL to only count them.
+ * @param fcount Updated with the number of facets.
+ */
+static bool
+mesh_gen_extrude_outline(struct mesh *mesh,
+                      bitmap *bm,
+                      options *options,
+                      uint32_t *fcount)
+{
+    struct extrude_run *runs;
+    struct extrude_run *prev;
+    struct extrude_run *cur;
+    struct extrude_run *tmp;
+    unsigned int pcount;
+    unsigned int ccount;
+    unsigned int *chains;
+    unsigned int *top;
+    unsigned int *bot;
+    unsigned int tcount;
+    unsigned int bcount;
+    uint8_t *marks;
+    unsigned int yloop;
+    unsigned int ploop;
+    unsigned int cloop;
+    unsigned int bstart;
+    unsigned int xloop;
+    struct extrude_run *run;
+    uint32_t count = 0;
+
+    runs = malloc(2 * ((bm->width / 2) + 1) * sizeof(struct extrude_run));
+    chains = malloc(2 * (bm->width + 2) * sizeof(unsigned int));
+    marks = calloc(bm->width + 1, 1);
+    if ((runs == NULL) || (chains == NULL) || (marks == NULL)) {
+        free(runs);
+        free(chains);
+        free(marks);
+        return false;
+    }
+    prev = runs;
+    cur = prev + (bm->width / 2) + 1;
+    top = chains;
+    bot = top + bm->width + 2;
+
+    pcount = 0;
+    for (yloop = 0; yloop <= bm->height; yloop++) {
+        ccount = extrude_row_runs(bm, options, yloop, cur);
+
+        /* close the rectangles whose run is not repeated on this row */
+        cloop = 0;
+        bstart = 0;
+        for (ploop = 0; ploop < pcount; ploop++) {
+            run = &prev[ploop];
+            while ((cloop < ccount) && (cur[cloop].x0 < run->x0)) {
+                cloop++;
+            }
+            if ((cloop < ccount) &&
+                (cur[cloop].x0 == run->x0) &&
+                (cur[cloop].x1 == run->x1)) {
+                cur[cloop].top = run->top;
+                continue;
+            }
+
+            tcount = 0;
+            top[tcount++] = run->x0;
+            for (xloop = run->x0 + 1; xloop < run->x1; xloop++) {
+                if (marks[xloop] != 0) {
+                    marks[xloop] = 0;
+                    top[tcount++] = xloop;
+                }
+            }
+            top[tcount++] = run->x1;
+
+            while ((bstart < ccount) && (cur[bstart].x1 <= run->x0)) {
+                bstart++;
+            }
+            bcount = 0;
+            bot[bcount++] = run->x0;
+            for (xloop = bstart;
+                 (xloop < ccount) && (cur[xloop].x0 < run->x1);
+                 xloop++) {
+                if (cur[xloop].x0 > run->x0) {
+                    bot[bcount++] = cur[xloop].x0;
+                }
+                if (cur[xloop].x1 < run->x1) {
+                    bot[bcount++] = cur[xloop].x1;
+                }
+            }
+            bot[bcount++] = run->x1;
+
+            if (mesh != NULL) {
+                mesh->cubes++;
+            }
+            count += extrude_caps(mesh,
+                                  top, tcount, 1.0f - run->top,
+                                  bot, bcount, 1.0f - yloop);
+            count += extrude_wall(mesh,
+                                  run->x0, 1.0f - yloop,
+                                  run->x0, 1.0f - run->top,
+                                  -1, 0);
+            count += extrude_wall(mesh,
+                                  run->x1, 1.0f - yloop,
+                                  run->x1, 1.0f - run->top,
+                                  1, 0);
+        }
+
+        /* open rectangles for the new runs marking the ends of the runs
+         * above them which lie on their top edge
+         */
+        ploop = 0;
+        for (cloop = 0; cloop < ccount; cloop++) {
+            run = &cur[cloop];
+            if (run->top != UINT_MAX) {
+                continue;
+            }
+            run->top = yloop;
+            while ((ploop < pcount) && (prev[ploop].x1 <= run->x0)) {
+                ploop++;
+            }
+            for (xloop = ploop;
+                 (xloop < pcount) && (prev[xloop].x0 < run->x1);
+                 xloop++) {
+                if (prev[xloop].x0 > run->x0) {
+                    marks[prev[xloop].x0] = 1;
+                }
+                if (prev[xloop].x1 < run->x1) {
+                    marks[prev[xloop].x1] = 1;
+                }
+            }
+        }
+
+        count += extrude_row_walls(mesh, prev, pcount, cur, ccount,
+                                   1.0f - yloop);
+
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+        pcount = ccount;
+    }
+
+    free(runs);
+    free(chains);
+    free(marks);
+
+    *fcount += count;
+
+    return true;
+}
+
+/* generate an extruded outline
+ *
+ * A single level image is simply its solid region extruded so rather than
+ * covering every pixel the region is split into as few rectangles as its
+ * outline allows and only those are covered.
+ */
+static bool mesh_gen_extrude(struct mesh *mesh, bitmap *bm, options *options)
+{
+    uint32_t fcount = 0;
+
+    if (!mesh_gen_extrude_outline(NULL, bm, options, &fcount) ||
+        !mesh_gen_reserve(mesh, mesh->fcount + fcount)) {
+        return false;
+    }
+
+    fcount = 0;
+    return mesh_gen_extrude_outline(mesh, bm, options, &fcount);
+}
+
+/** The lattice edge on the left of a location is a side of a box */
+#define RECT_EDGE_LEFT 1
+
+/** The lattice edge on the top of a location is a side of a box */
+#define RECT_EDGE_TOP 2
+
+/** The location is covered by a box */
+#define RECT_COVERED 4
+
+/** a box of the rectangular cuboid finish */
+struct rect_box {
+    unsigned int x; /**< left location of the box */
+    unsigned int y; /**< top row of the box */
+    unsigned int width; /**< number of locations across the box */
+    unsigned int height; /**< number of rows in the box */
+    unsigned int depth; /**< number of levels the box fills */
+};
+
+/** decomposition of the solid area into boxes
+ *
+ * The heights and edge flags are padded with an empty location on every
+ * side so the locations around any lattice point can be read directly.
+ */
+struct rect_boxes {
+    unsigned int stride; /**< entries on a row of the padded arrays */
+    unsigned int width; /**< bitmap width */
+    unsigned int height; /**< bitmap height */
+    uint16_t *h; /**< column height of each location */
+    uint8_t *edges; /**< edge and cover flags of each location */
+    struct rect_box *box; /**< the boxes in the order they were found */
+    unsigned int count; /**< number of boxes */
+};
+
+/** column height of a location, locations just outside the bitmap are empty */
+static inline unsigned int
+rect_height(const struct rect_boxes *boxes, int x, int y)
+{
+    return boxes->h[((y + 1) * boxes->stride) + x + 1];
+}
+
+/** edge flags of a location, locations just outside the bitmap have none */
+static inline uint8_t *
+rect_edges(const struct rect_boxes *boxes, int x, int y)
+{
+    return boxes->edges + ((y + 1) * boxes->stride) + x + 1;
+}
+
+/** check if a lattice point is the corner of a box
+ *
+ * Only box corners need to be vertices as elsewhere on a box side the boxes
+ * either side of it run straight past the point.
+ */
+static inline bool
+rect_corner(const struct rect_boxes *boxes, int x, int y)
+{
+    const uint8_t *e = rect_edges(boxes, x, y);
+
+    return (((e[-(int)boxes->stride] | e[0]) & RECT_EDGE_LEFT) != 0) &&
+           (((e[-1] | e[0]) & RECT_EDGE_TOP) != 0);
+}
+
+/** free the storage of a box decomposition */
+static void
+rect_fini(struct rect_boxes *boxes)
+{
+    free(boxes->h);
+    free(boxes->edges);
+    free(boxes->box);
+}
+
+/** decompose the solid area into boxes of a single height
+ *
+ * Each box is grown greedily as far as possible along its row over
+ * locations of the same height and then down following rows while they are
+ * completely covered by that height. Each box stands from the base up to
+ * its height and the edges of every box side are flagged.
+ */
+static bool
+rect_decompose(bitmap *bm, options *options, struct rect_boxes *boxes)
+{
+    const bitmap_span *span;
+    unsigned int count;
+    unsigned int balloc = 0;
+    unsigned int sloop;
+    unsigned int yloop;
+    unsigned int xloop;
+    unsigned int rloop;
+    unsigned int loop;
+    struct rect_box *box;
+    uint16_t *hrow;
+    uint8_t *erow;
+    size_t size;
+
+    boxes->stride = bm->width + 2;
+    boxes->width = bm->width;
+    boxes->height = bm->height;
+    boxes->count = 0;
+    boxes->box = NULL;
+
+    size = (size_t)boxes->stride * (bm->height + 2);
+    boxes->h = calloc(size, sizeof(uint16_t));
+    boxes->edges = calloc(size, 1);
+    if ((boxes->h == NULL) || (boxes->edges == NULL)) {
+        rect_fini(boxes);
+        return false;
+    }
+
+    /* rows without runs are left empty */
+    for (yloop = 0; yloop < bm->height; yloop++) {
+        if (bm->span_row[yloop] != bm->span_row[yloop + 1]) {
+            mesh_gen_column_row(bm, options, yloop,
+                                boxes->h + ((yloop + 1) * boxes->stride));
+        }
+    }
+
+    for (yloop = 0; yloop < bm->height; yloop++) {
+        span = mesh_gen_row_spans(bm, yloop, &count);
+        hrow = boxes->h + ((yloop + 1) * boxes->stride) + 1;
+        erow = rect_edges(boxes, 0, yloop);
+
+        for (sloop = 0; sloop < count; sloop++) {
+            for (xloop = span[sloop].start; xloop < span[sloop].end; xloop++) {
+                if ((erow[xloop] & RECT_COVERED) != 0) {
+                    continue;
+                }
+
+                if (boxes->count == balloc) {
+                    balloc = (balloc * 2) + 64;
+                    box = realloc(boxes->box, balloc * sizeof(struct rect_box));
+                    if (box == NULL) {
+                        rect_fini(boxes);
+                        return false;
+                    }
+                    boxes->box = box;
+                }
+                box = &boxes->box[boxes->count++];
+                box->x = xloop;
+                box->y = yloop;
+                box->depth = hrow[xloop];
+
+                /* grow along the row */
+                box->width = 1;
+                while (((xloop + box->width) < span[sloop].end) &&
+                       (hrow[xloop + box->width] == box->depth) &&
+                       ((erow[xloop + box->width] & RECT_COVERED) == 0)) {
+                    box->width++;
+                }
+
+                /* grow down while the whole width is the same height */
+                box->height = 1;
+                while ((yloop + box->height) < bm->height) {
+                    const uint16_t *next = hrow + (box->height * boxes->stride);
+                    const uint8_t *enext = erow + (box->height * boxes->stride);
+
+                    for (loop = xloop; loop < (xloop + box->width); loop++) {
+                        if ((next[loop] != box->depth) ||
+                            ((enext[loop] & RECT_COVERED) != 0)) {
+                            break;
+                        }
+                    }
+                    if (loop != (xloop + box->width)) {
+                        break;
+                    }
+                    box->height++;
+                }
+
+                /* cover the box and flag its sides */
+                for (rloop = 0; rloop < box->height; rloop++) {
+                    uint8_t *e = erow + (rloop * boxes->stride);
+
+                    for (loop = xloop; loop < (xloop + box->width); loop++) {
+                        e[loop] |= RECT_COVERED;
+                    }
+                    e[xloop] |= RECT_EDGE_LEFT;
+                    e[xloop + box->width] |= RECT_EDGE_LEFT;
+                }
+                for (loop = xloop; loop < (xloop + box->width); loop++) {
+                    erow[loop] |= RECT_EDGE_TOP;
+                    erow[loop + (box->height * boxes->stride)] |= RECT_EDGE_TOP;
+                }
+
+                xloop += box->width - 1;
+            }
+        }
+    }
+
+    return true;
+}
+
+/** add a cap of a box
+ *
+ * Every box corner on the sides of the box is a vertex of the cap. The
+ * left side is fanned from the second bottom point, the right side from the
+ * penultimate top point and the band between those fans is zipped together,
+ * as for a merged face.
+ *
+ * @param bot The locations of the points along the bottom edge.
+ * @param top The locations of the points along the top edge.
+ * @param left The heights of the points up the left edge.
+ * @param right The heights of the points up the right edge.
+ * @param up The cap faces up, otherwise it faces down.
+ * @return The number of facets in the cap.
+ */
+static uint32_t
+rect_cap(struct mesh *mesh,
+         const float *bot, unsigned int bcount, float ybot,
+         const float *top, unsigned int tcount, float ytop,
+         const float *left, unsigned int lcount,
+         const float *right, unsigned int rcount,
+         float z, bool up)
+{
+    unsigned int bloop;
+    unsigned int tloop;
+    unsigned int loop;
+
+    if (mesh == NULL) {
+        return (bcount - 2) + (tcount - 2) + (lcount - 1) + (rcount - 1);
+    }
+
+    /* left edge fan from the second bottom point */
+    for (loop = 0; loop < (lcount - 1); loop++) {
+        mesh_gen_plane_facet(mesh,
+                             bot[1], ybot,
+                             bot[0], left[loop],
+                             bot[0], left[loop + 1],
+                             z, up);
+    }
+
+    /* right edge fan from the penultimate top point */
+    for (loop = 0; loop < (rcount - 1); loop++) {
+        mesh_gen_plane_facet(mesh,
+                             top[tcount - 2], ytop,
+                             top[tcount - 1], right[loop],
+                             top[tcount - 1], right[loop + 1],
+                             z, up);
+    }
+
+    /* zip the bottom points from the second with the top points up to the
+     * penultimate
+     */
+    bloop = 1;
+    tloop = 0;
+    while (((bloop + 1) < bcount) || ((tloop + 2) < tcount)) {
+        if (((tloop + 2) == tcount) ||
+            (((bloop + 1) < bcount) && (bot[bloop + 1] <= top[tloop + 1]))) {
+            mesh_gen_plane_facet(mesh,
+                                 bot[bloop], ybot,
+                                 bot[bloop + 1], ybot,
+                                 top[tloop], ytop,
+                                 z, up);
+            bloop++;
+        } else {
+            mesh_gen_plane_facet(mesh,
+                                 top[tloop], ytop,
+                                 bot[bloop], ybot,
+                                 top[tloop + 1], ytop,
+                                 z, up);
+            tloop++;
+        }
+    }
+
+    return (bcount - 2) + (tcount - 2) + (lcount - 1) + (rcount - 1);
+}
+
+/** add the walls along a lattice row and up a lattice column
+ *
+ * A box side runs straight between box corners so between two corners it
+ * separates the same two boxes and a wall spanning their difference in
+ * height is added if they differ. The vertical ends of each wall carry the
+ * heights of the locations around the corner so the walls and caps meeting
+ * there join without T junctions.
+ *
+ * @param vstart The row each lattice column side started on or UINT_MAX
+ *               if there is no side open on the column.
+ * @param y The lattice row.
+ * @return The number of facets in the walls.
+ */
+static uint32_t
+rect_walls(struct mesh *mesh,
+           const struct rect_boxes *boxes,
+           unsigned int *vstart,
+           unsigned int y)
+{
+    const uint8_t *e = rect_edges(boxes, 0, y);
+    unsigned int achain[4];
+    unsigned int bchain[4];
+    unsigned int acount;
+    unsigned int bcount;
+    unsigned int xloop;
+    unsigned int xa;
+    unsigned int ya;
+    unsigned int ha;
+    unsigned int hb;
+    unsigned int lo;
+    unsigned int hi;
+    uint32_t count = 0;
+
+    /* sides along the lattice row */
+    for (xloop = 0; xloop < boxes->width; xloop++) {
+        if ((e[xloop] & RECT_EDGE_TOP) == 0) {
+            continue;
+        }
+        xa = xloop;
+        do {
+            xloop++;
+        } while (((e[xloop] & RECT_EDGE_TOP) != 0) &&
+                 !rect_corner(boxes, xloop, y));
+
+        ha = rect_height(boxes, xa, (int)y - 1);
+        hb = rect_height(boxes, xa, y);
+        if (ha != hb) {
+            lo = (ha < hb) ? ha : hb;
+            hi = ha + hb - lo;
+            acount = mesh_gen_wall_chain(lo, hi,
+                                         rect_height(boxes, (int)xa - 1, (int)y - 1),
+                                         rect_height(boxes, (int)xa - 1, y),
+                                         achain);
+            bcount = mesh_gen_wall_chain(lo, hi,
+                                         rect_height(boxes, xloop, (int)y - 1),
+                                         rect_height(boxes, xloop, y),
+                                         bchain);
+            count += mesh_gen_wall(mesh,
+                                   xa, 1.0f - y, achain, acount,
+                                   xloop, 1.0f - y, bchain, bcount,
+                                   0, (hb > ha) ? 1 : -1);
+        }
+        xloop--;
+    }
+
+    /* sides up the lattice columns ending on the lattice row */
+    for (xloop = 0; xloop <= boxes->width; xloop++) {
+        if ((vstart[xloop] != UINT_MAX) &&
+            (((e[xloop] & RECT_EDGE_LEFT) == 0) || rect_corner(boxes, xloop, y))) {
+            ya = vstart[xloop];
+            vstart[xloop] = UINT_MAX;
+
+            ha = rect_height(boxes, (int)xloop - 1, ya);
+            hb = rect_height(boxes, xloop, ya);
+            if (ha != hb) {
+                lo = (ha < hb) ? ha : hb;
+                hi = ha + hb - lo;
+                acount = mesh_gen_wall_chain(lo, hi,
+                                             rect_height(boxes, (int)xloop - 1, (int)ya - 1),
+                                             rect_height(boxes, xloop, (int)ya - 1),
+                                             achain);
+                bcount = mesh_gen_wall_chain(lo, hi,
+                                             rect_height(boxes, (int)xloop - 1, y),
+                                             rect_height(boxes, xloop, y),
+                                             bchain);
+                count += mesh_gen_wall(mesh,
+                                       xloop, 1.0f - ya, achain, acount,
+                                       xloop, 1.0f - y, bchain, bcount,
+                                       (hb > ha) ? -1 : 1, 0);
+            }
+        }
+        if (((e[xloop] & RECT_EDGE_LEFT) != 0) && (vstart[xloop] == UINT_MAX)) {
+            vstart[xloop] = y;
+        }
+    }
+
+    return count;
+}
+
+/** generate or count the facets of a box decomposition
+ *
+ * Each box is covered by a cap at its height and one on the base, the
+ * faces where boxes touch are left out and walls are only added where the
+ * boxes either side of a box side differ in height.
  *
- * @todo This could probably be better converted to a marching cubes solution
- *       instead  http://en.wikipedia.org/wiki/Marching_cubes
+ * @param mesh The mesh to add the facets to or NULL to only count them.
+ * @param fcount Updated with the number of facets.
  */
-static bool mesh_gen_cubes(struct mesh *mesh, bitmap *bm, options *options)
+static bool
+mesh_gen_rect_boxes(struct mesh *mesh,
+                    bitmap *bm,
+                    const struct rect_boxes *boxes,
+                    uint32_t *fcount)
 {
-    unsigned int yloop;
-    unsigned int xloop;
-    unsigned int zloop;
-    uint32_t faces;
-
-    for (zloop = 0; zloop < options->levels; zloop++) {
-        for (yloop = 0; yloop < bm->height; yloop++) {
-            for (xloop = 0; xloop < bm->width; xloop++) {
-                faces = mesh_gen_get_face(bm, xloop, yloop, zloop, options);
-                mesh_gen_cube(mesh, xloop, -(float)yloop, zloop, 1, 1, 1, faces);
+    float *points;
+    float *bot;
+    float *top;
+    float *left;
+    float *right;
+    unsigned int bcount;
+    unsigned int tcount;
+    unsigned int lcount;
+    unsigned int rcount;
+    unsigned int *vstart;
+    const struct rect_box *box;
+    unsigned int bloop;
+    unsigned int loop;
+    unsigned int ybot;
+    uint32_t count = 0;
+
+    points = malloc(2 * ((boxes->width + 1) + (boxes->height + 1)) * sizeof(float));
+    vstart = malloc((boxes->width + 1) * sizeof(unsigned int));
+    if ((points == NULL) || (vstart == NULL)) {
+        free(points);
+        free(vstart);
+        return false;
+    }
+    bot = points;
+    top = bot + boxes->width + 1;
+    left = top + boxes->width + 1;
+    right = left + boxes->height + 1;
+
+    for (bloop = 0; bloop < boxes->count; bloop++) {
+        box = &boxes->box[bloop];
+        ybot = box->y + box->height;
+
+        bcount = 0;
+        tcount = 0;
+        bot[bcount++] = box->x;
+        top[tcount++] = box->x;
+        for (loop = box->x + 1; loop < (box->x + box->width); loop++) {
+            if (rect_corner(boxes, loop, ybot)) {
+                bot[bcount++] = loop;
+            }
+            if (rect_corner(boxes, loop, box->y)) {
+                top[tcount++] = loop;
+            }
+        }
+        bot[bcount++] = box->x + box->width;
+        top[tcount++] = box->x + box->width;
+
+        lcount = 0;
+        rcount = 0;
+        left[lcount++] = 1.0f - ybot;
+        right[rcount++] = 1.0f - ybot;
+        for (loop = ybot - 1; loop > box->y; loop--) {
+            if (rect_corner(boxes, box->x, loop)) {
+                left[lcount++] = 1.0f - loop;
             }
+            if (rect_corner(boxes, box->x + box->width, loop)) {
+                right[rcount++] = 1.0f - loop;
+            }
+        }
+        left[lcount++] = 1.0f - box->y;
+        right[rcount++] = 1.0f - box->y;
+
+        if (mesh != NULL) {
+            mesh->cubes++;
+        }
+        count += rect_cap(mesh,
+                          bot, bcount, 1.0f - ybot,
+                          top, tcount, 1.0f - box->y,
+                          left, lcount, right, rcount,
+                          box->depth, true);
+        count += rect_cap(mesh,
+                          bot, bcount, 1.0f - ybot,
+                          top, tcount, 1.0f - box->y,
+                          left, lcount, right, rcount,
+                          0, false);
+    }
+
+    for (loop = 0; loop <= boxes->width; loop++) {
+        vstart[loop] = UINT_MAX;
+    }
+    /* only lattice rows next to a row with runs can have box sides */
+    for (loop = 0; loop <= boxes->height; loop++) {
+        if (((loop == 0) ||
+             (bm->span_row[loop - 1] == bm->span_row[loop])) &&
+            ((loop == boxes->height) ||
+             (bm->span_row[loop] == bm->span_row[loop + 1]))) {
+            continue;
         }
+        count += rect_walls(mesh, boxes, vstart, loop);
     }
-    
+
+    free(points);
+    free(vstart);
+
+    *fcount += count;
+
     return true;
 }
 
+/* generate rectangular cuboids
+ *
+ * The solid area is decomposed into boxes which are welded together into
+ * a single mesh, an isolated box has only the twelve facets of its faces.
+ */
+static bool mesh_gen_rect(struct mesh *mesh, bitmap *bm, options *options)
+{
+    struct rect_boxes boxes;
+    uint32_t fcount = 0;
+    bool res;
 
+    if (!rect_decompose(bm, options, &boxes)) {
+        return false;
+    }
 
-static inline float 
-surfacegen_calcp(bitmap *bm,
-                 int x, 
-                 int y,
-                 options *options)
+    INFO("Decomposed into %d boxes\n", boxes.count);
+
+    res = mesh_gen_rect_boxes(NULL, bm, &boxes, &fcount) &&
+          mesh_gen_reserve(mesh, mesh->fcount + fcount) &&
+          mesh_gen_rect_boxes(mesh, bm, &boxes, &fcount);
+
+    rect_fini(&boxes);
+
+    return res;
+}
+
+/** count the facets of the rectangular cuboid finish */
+static uint32_t
+mesh_gen_rect_count(bitmap *bm, options *options)
 {
-    uint8_t pxl_val;
-    int res;
+    struct rect_boxes boxes;
+    uint32_t fcount = 0;
 
-    /* range check, casts are safe because value cannot be -ve from previous
-     * test.
-     */
-    if ((x < 0) || ((unsigned int)x >= bm->width) || 
-        (y < 0) || ((unsigned int)y >= bm->height)) {
-        return 0.0f;
+    if (!rect_decompose(bm, options, &boxes)) {
+        return 0;
     }
-        
-    pxl_val = bm->data[(y * bm->width) + x];
 
-    if (pxl_val == options->transparent) {
-        return 0.0f;
-    } 
+    if (!mesh_gen_rect_boxes(NULL, bm, &boxes, &fcount)) {
+        fcount = 0;
+    }
 
-    res = 1+(pxl_val + 1) / (256 / options->levels);
+    rect_fini(&boxes);
 
-    return res;
+    return fcount;
 }
 
-#define ADDSF(xa,ya,za,xb,yb,zb,xc,yc,zc) mesh_add_facet(mesh,           \
-        x + (xa * width), y + (ya * height), za * points[xa][ya],          \
-        x + (xb * width), y + (yb * height), zb * points[xb][yb],          \
-        x + (xc * width), y + (yc * height), zc * points[xc][yc])
+/** Base of a surface network midpoint must be split with the surface */
+#define RTIN_BASE_SPLIT 0x8000
 
-static void
-gen_surface(struct mesh *mesh,
-                 float x, float y, 
-                 float width, float height, 
-                 bool evenp, float points[2][2])
+/** Diamond about a surface network midpoint contains a zero height */
+#define RTIN_ZERO 0x4000
+
+/** Diamond about a surface network midpoint contains a non zero height */
+#define RTIN_SOLID 0x2000
+
+/** Twice the surface error at a surface network midpoint */
+#define RTIN_ERROR 0x1fff
+
+/** right triangulated irregular network of a heightmap surface
+ *
+ * The surface lattice is padded to a square of 2^n + 1 locations which is
+ * recursively bisected into right triangles, each split at the midpoint of
+ * its hypotenuse. The triangle sharing a hypotenuse shares its midpoint so
+ * splitting wherever the midpoint entry requires it always gives a mesh
+ * without T junctions.
+ *
+ * Each midpoint entry holds twice the greatest height error of the
+ * triangles about it and their descendants. The surface is split where that
+ * exceeds the tolerance or the diamond about the midpoint has both zero and
+ * non zero heights so the outline of the solid is always exact. The base is
+ * flat so only needs splitting where the surface is split and the diamond
+ * touches a zero height location, which keeps the base triangles along the
+ * edge of the surface identical to the surface triangles.
+ */
+struct rtin {
+    bitmap *bm;
+    options *options;
+    unsigned int size; /**< number of locations along each side */
+    uint16_t *mid; /**< midpoint entries */
+    unsigned int tolerance; /**< twice the acceptable height error */
+};
+
+/** height of the surface at a lattice location */
+static inline unsigned int
+rtin_height(struct rtin *rtin, unsigned int x, unsigned int y)
 {
-    if (evenp) {
-        if ( (points[0][0] != 0) || 
-             (points[1][1] != 0) || 
-             (points[0][1] != 0)) {
-            /* top surface */
-            ADDSF(0,0,1, 0,1,1, 1,1,1);
+    return surfacegen_calcp(rtin->bm, (int)x - 1, (int)y - 1, rtin->options);
+}
 
-            /* flat bottom */
-            ADDSF(0,0,0, 1,1,0, 0,1,0);
+/** surface must be split at a midpoint entry */
+static inline bool
+rtin_split(struct rtin *rtin, uint16_t entry)
+{
+    return ((entry & (RTIN_ZERO | RTIN_SOLID)) == (RTIN_ZERO | RTIN_SOLID)) ||
+           ((unsigned int)(entry & RTIN_ERROR) > rtin->tolerance);
+}
+
+/** base must be split at a midpoint entry */
+static inline bool
+rtin_base_split(struct rtin *rtin, uint16_t entry)
+{
+    return ((entry & RTIN_BASE_SPLIT) != 0) ||
+           (((entry & RTIN_ZERO) != 0) && rtin_split(rtin, entry));
+}
+
+/** calculate the midpoint entries of the surface network
+ *
+ * Triangles are numbered from two as a binary heap, the two halves of the
+ * square then each bisection doubling the number. Triangles are visited
+ * from the smallest so every entry of the children of a triangle is
+ * complete before the triangle is visited.
+ */
+static bool
+rtin_init(struct rtin *rtin, bitmap *bm, options *options)
+{
+    unsigned int tile;
+    uint32_t tcount;
+    uint32_t pcount;
+    uint32_t tloop;
+    uint32_t id;
+    unsigned int ax, ay, bx, by, cx, cy, mx, my;
+    unsigned int ha, hb, hc, hm;
+    unsigned int err;
+    uint16_t entry;
+    uint16_t child;
+
+    rtin->bm = bm;
+    rtin->options = options;
+    rtin->tolerance = options->tolerance * 2;
+
+    rtin->size = rtin_side(bm);
+    tile = rtin->size - 1;
+
+    rtin->mid = calloc((size_t)rtin->size * rtin->size, sizeof(uint16_t));
+    if (rtin->mid == NULL) {
+        return false;
+    }
+
+    tcount = (tile * tile * 2) - 2;
+    pcount = tcount - (tile * tile);
+
+    for (tloop = tcount; tloop-- > 0; ) {
+        /* locate the triangle from its number */
+        id = tloop + 2;
+        ax = ay = bx = by = cx = cy = 0;
+        if ((id & 1) != 0) {
+            bx = by = cx = tile;
+        } else {
+            ax = ay = cy = tile;
+        }
+        while ((id >>= 1) > 1) {
+            mx = (ax + bx) >> 1;
+            my = (ay + by) >> 1;
+            if ((id & 1) != 0) {
+                bx = ax;
+                by = ay;
+                ax = cx;
+                ay = cy;
+            } else {
+                ax = bx;
+                ay = by;
+                bx = cx;
+                by = cy;
+            }
+            cx = mx;
+            cy = my;
         }
 
-        if ( (points[0][0] != 0) || 
-             (points[1][0] != 0) || 
-             (points[1][1] != 0)) {
+        mx = (ax + bx) >> 1;
+        my = (ay + by) >> 1;
 
-            /* top surface */
-            ADDSF(0,0,1, 1,1,1, 1,0,1);
+        ha = rtin_height(rtin, ax, ay);
+        hb = rtin_height(rtin, bx, by);
+        hc = rtin_height(rtin, cx, cy);
+        hm = rtin_height(rtin, mx, my);
 
-            /* flat bottom */
-            ADDSF(0,0,0, 1,0,0, 1,1,0);
+        entry = rtin->mid[(my * rtin->size) + mx];
+
+        err = (ha + hb > 2 * hm) ? (ha + hb - (2 * hm)) : ((2 * hm) - ha - hb);
+        if (err > (unsigned int)(entry & RTIN_ERROR)) {
+            entry = (entry & ~RTIN_ERROR) | err;
         }
 
-    } else {
-        if ( (points[0][0] != 0) || 
-             (points[1][0] != 0) || 
-             (points[0][1] != 0)) {
+        if ((ha == 0) || (hb == 0) || (hc == 0) || (hm == 0)) {
+            entry |= RTIN_ZERO;
+        }
+        if ((ha != 0) || (hb != 0) || (hc != 0) || (hm != 0)) {
+            entry |= RTIN_SOLID;
+        }
 
-            /* top surface */
-            ADDSF(0,0,1, 0,1,1, 1,0,1);
+        if (tloop < pcount) {
+            unsigned int cloop;
+            unsigned int child_mid[2];
 
-            /* flat bottom */
-            ADDSF(0,0,0, 1,0,0, 0,1,0);
+            child_mid[0] = (((ay + cy) >> 1) * rtin->size) + ((ax + cx) >> 1);
+            child_mid[1] = (((by + cy) >> 1) * rtin->size) + ((bx + cx) >> 1);
+
+            for (cloop = 0; cloop < 2; cloop++) {
+                child = rtin->mid[child_mid[cloop]];
+
+                if ((child & RTIN_ERROR) > (entry & RTIN_ERROR)) {
+                    entry = (entry & ~RTIN_ERROR) | (child & RTIN_ERROR);
+                }
+                entry |= (child & (RTIN_ZERO | RTIN_SOLID));
+                if (rtin_base_split(rtin, child)) {
+                    entry |= RTIN_BASE_SPLIT;
+                }
+            }
         }
 
-        if ( (points[1][0] != 0) || 
-             (points[1][1] != 0) || 
-             (points[0][1] != 0)) {
-            /* top surface */
-            ADDSF(1,0,1, 0,1,1, 1,1,1);
+        rtin->mid[(my * rtin->size) + mx] = entry;
+    }
 
-            /* flat bottom */
-            ADDSF(1,0,0, 1,1,0, 0,1,0);
+    return true;
+}
+
+/** add a surface network facet ordered to face up or down */
+static void
+rtin_facet(struct mesh *mesh,
+           struct rtin *rtin,
+           unsigned int ax, unsigned int ay,
+           unsigned int bx, unsigned int by,
+           unsigned int cx, unsigned int cy,
+           bool top)
+{
+    float az = 0;
+    float bz = 0;
+    float cz = 0;
+    int area;
+
+    if (top) {
+        az = rtin_height(rtin, ax, ay);
+        bz = rtin_height(rtin, bx, by);
+        cz = rtin_height(rtin, cx, cy);
+    }
+
+    /* twice the signed area in the output plane where y is negated */
+    area = (((int)bx - (int)ax) * ((int)ay - (int)cy)) -
+           (((int)ay - (int)by) * ((int)cx - (int)ax));
+
+    if ((area > 0) == top) {
+        mesh_add_facet(mesh,
+                       ax, -(float)ay, az,
+                       bx, -(float)by, bz,
+                       cx, -(float)cy, cz);
+    } else {
+        mesh_add_facet(mesh,
+                       ax, -(float)ay, az,
+                       cx, -(float)cy, cz,
+                       bx, -(float)by, bz);
+    }
+}
+
+/** add or count the facets of a surface network triangle
+ *
+ * @param mesh The mesh to add the facets to or NULL to only count them.
+ * @param top Generate the surface rather than the base.
+ * @return The number of facets.
+ */
+static uint32_t
+rtin_triangle(struct mesh *mesh,
+              struct rtin *rtin,
+              unsigned int ax, unsigned int ay,
+              unsigned int bx, unsigned int by,
+              unsigned int cx, unsigned int cy,
+              bool top)
+{
+    unsigned int mx = (ax + bx) >> 1;
+    unsigned int my = (ay + by) >> 1;
+    uint16_t entry;
+    bool split = false;
+
+    if ((abs((int)ax - (int)cx) + abs((int)ay - (int)cy)) > 1) {
+        entry = rtin->mid[(my * rtin->size) + mx];
+        if (top) {
+            split = rtin_split(rtin, entry);
+        } else {
+            split = rtin_base_split(rtin, entry);
         }
     }
+
+    if (split) {
+        return rtin_triangle(mesh, rtin, cx, cy, ax, ay, mx, my, top) +
+               rtin_triangle(mesh, rtin, bx, by, cx, cy, mx, my, top);
+    }
+
+    /* triangles with every corner on the base are not part of the solid */
+    if ((rtin_height(rtin, ax, ay) == 0) &&
+        (rtin_height(rtin, bx, by) == 0) &&
+        (rtin_height(rtin, cx, cy) == 0)) {
+        return 0;
+    }
+
+    if (mesh != NULL) {
+        rtin_facet(mesh, rtin, ax, ay, bx, by, cx, cy, top);
+    }
+
+    return 1;
+}
+
+/** add or count the facets of the surface network surface and base */
+static uint32_t
+rtin_mesh(struct mesh *mesh, struct rtin *rtin)
+{
+    unsigned int tile = rtin->size - 1;
+    uint32_t fcount = 0;
+    unsigned int tloop;
+
+    for (tloop = 0; tloop < 2; tloop++) {
+        fcount += rtin_triangle(mesh, rtin, 0, 0, tile, tile, tile, 0, tloop == 0);
+        fcount += rtin_triangle(mesh, rtin, tile, tile, 0, 0, 0, tile, tloop == 0);
+    }
+
+    return fcount;
+}
+
+/* generate adaptive heightmap surface
+ *
+ * The surface is triangulated from a right triangulated irregular network
+ * only splitting triangles whose height error exceeds the tolerance and
+ * the flat base is covered with as few triangles as meet the surface edge.
+ */
+static bool
+mesh_gen_surface_adaptive(struct mesh *mesh, bitmap *bm, options *options)
+{
+    struct rtin rtin;
+    bool res;
+
+    if (!rtin_init(&rtin, bm, options)) {
+        return false;
+    }
+
+    res = mesh_gen_reserve(mesh, mesh->fcount + rtin_mesh(NULL, &rtin));
+    if (res) {
+        rtin_mesh(mesh, &rtin);
+    }
+
+    free(rtin.mid);
+
+    return res;
 }
 
+/** count the facets of the adaptive heightmap surface */
+static uint32_t
+mesh_gen_surface_adaptive_count(bitmap *bm, options *options)
+{
+    struct rtin rtin;
+    uint32_t fcount;
+
+    if (!rtin_init(&rtin, bm, options)) {
+        return 0;
+    }
+
+    fcount = rtin_mesh(NULL, &rtin);
+
+    free(rtin.mid);
+
+    return fcount;
+}
 
 static bool mesh_gen_surface(struct mesh *mesh, bitmap *bm, options *options)
 {
-    unsigned int yloop;
-    unsigned int xloop;
-    float points[2][2];
+    rowgenerator *rowgen;
+    rowcounter *rowcount;
+    unsigned int rows;
 
-    for (yloop = 0; yloop <= bm->height; yloop++) {
-        for (xloop = 0; xloop <= bm->width; xloop++) {
+    if (mesh_gen_surface_adaptive_fits(bm, options)) {
+        return mesh_gen_surface_adaptive(mesh, bm, options);
+    }
+
+    rows = mesh_gen_row_finish(bm, options, &rowgen, &rowcount);
+    return mesh_gen_rows(mesh, bm, options, rowgen, rowcount, 0, rows);
+}
+
+/** create the rolling vertex index for generating a mesh
+ *
+ * The surface generator places vertices one column further right and each
+ * location has only a base vertex and a surface vertex above it, the others
+ * place vertices up to the number of levels.
+ */
+static struct gen_index *
+mesh_gen_index_init(bitmap *bm, options *options)
+{
+    struct gen_index *gindex;
+    size_t row_size;
+
+    gindex = calloc(1, sizeof(struct gen_index));
+    if (gindex == NULL) {
+        return NULL;
+    }
 
-            points[0][0] = surfacegen_calcp(bm, xloop - 1, yloop - 1, options);
-            points[1][0] = surfacegen_calcp(bm, xloop, yloop - 1, options);
-            points[0][1] = surfacegen_calcp(bm, xloop - 1, yloop, options);
-            points[1][1] = surfacegen_calcp(bm, xloop, yloop, options);
+    gindex->xsize = bm->width + 2;
+    if (options->finish == FINISH_SURFACE) {
+        gindex->zsize = 2;
+        gindex->planes = true;
+    } else {
+        gindex->zsize = options->levels + 1;
+    }
+
+    row_size = (size_t)gindex->xsize * gindex->zsize;
+    gindex->row[0] = calloc(row_size * 2, sizeof(idxvtx));
+    if (gindex->row[0] == NULL) {
+        free(gindex);
+        return NULL;
+    }
+    gindex->row[1] = gindex->row[0] + row_size;
+
+    return gindex;
+}
+
+static void
+mesh_gen_index_fini(struct gen_index *gindex)
+{
+    free(gindex->row[0]);
+    free(gindex);
+}
+
+/* exported method documented in mesh_gen.h */
+uint32_t
+mesh_gen_facet_count(bitmap *bm, options *options)
+{
+    rowgenerator *rowgen;
+    rowcounter *rowcount;
+    unsigned int rows;
+    uint32_t fcount = 0;
+    uint8_t *frow;
+
+    mesh_gen_cases_init();
 
-            gen_surface(mesh,
-                             xloop, -(float)yloop,
-                             1, -1, 
-                             (((xloop + yloop) & 1) == 0), 
-                             points);
+    if (!bitmap_spans(bm, options->transparent)) {
+        return 0;
+    }
 
+    rows = mesh_gen_row_finish(bm, options, &rowgen, &rowcount);
+    if (rows == 0) {
+        if (options->finish == FINISH_SURFACE) {
+            fcount = mesh_gen_surface_adaptive_count(bm, options);
+        } else if (options->finish == FINISH_EXTRUDE) {
+            mesh_gen_extrude_outline(NULL, bm, options, &fcount);
+        } else if (options->finish == FINISH_RECT) {
+            fcount = mesh_gen_rect_count(bm, options);
         }
+        return fcount;
     }
-    return true;
+
+    frow = malloc(bm->width + 1);
+    if (frow == NULL) {
+        return 0;
+    }
+
+    fcount = rowcount(bm, options, 0, rows, frow);
+
+    free(frow);
+
+    return fcount;
 }
 
 /* exported method documented in mesh_gen.h */
 bool
-mesh_from_bitmap(struct mesh *mesh, bitmap *bm, options *options)
+mesh_from_bitmap(struct mesh *mesh, bitmap *bm, options *options, bool indexed)
 {
     bool res = false;
 
     mesh->height = bm->height;
     mesh->width = bm->width;
 
+    /* the generators place vertices at integer lattice locations apart from
+     * marching cubes which places them midway between voxel centres
+     */
+    mesh->lattice = (options->finish != FINISH_SMOOTH) || (options->levels == 1);
+
     INFO("Generating mesh from bitmap of size %dx%d with %d levels\n",
          bm->width, bm->height, options->levels);
 
+    mesh_gen_cases_init();
+
+    /* the generators visit only the runs of opaque pixels */
+    if (!bitmap_spans(bm, options->transparent)) {
+        return false;
+    }
+
+    /* index vertices as they are generated, if that is not possible, a
+     * specific index method was selected or several threads are available
+     * for the sharded indexer the mesh is left unindexed and index_mesh()
+     * does the work afterwards. Merged faces, boxes, extruded outlines and
+     * adaptive surfaces span many rows and marching cubes vertices are off the
+     * lattice so cannot be indexed with the rolling row index.
+     */
+    if (indexed &&
+        mesh->lattice &&
+        (options->finish != FINISH_RECT) &&
+        (options->finish != FINISH_EXTRUDE) &&
+        ((options->finish != FINISH_SURFACE) ||
+         !mesh_gen_surface_adaptive_fits(bm, options)) &&
+        (options->merge == false) &&
+        (options->index_method == INDEX_AUTO) &&
+        (options->threads <= 1)) {
+        mesh->gindex = mesh_gen_index_init(bm, options);
+    }
+
     switch (options->finish) {
     case FINISH_SURFACE:
         res = mesh_gen_surface(mesh, bm, options);
         break;
 
     case FINISH_SMOOTH:
+    case FINISH_TERRACE:
         res = mesh_gen_squares(mesh, bm, options);
         break;
 
@@ -706,10 +4317,94 @@ mesh_from_bitmap(struct mesh *mesh, bitmap *bm, options *options)
         res = mesh_gen_cubes(mesh, bm, options);
         break;
 
+    case FINISH_EXTRUDE:
+        res = mesh_gen_extrude(mesh, bm, options);
+        break;
+
     case FINISH_RECT:
-        fprintf(stderr, "Cannot generate mesh with Rectangular Cuboid finish\n");
+        res = mesh_gen_rect(mesh, bm, options);
         break;
     }
 
+    /* a merged face could not be added */
+    if (mesh->truncated) {
+        res = false;
+    }
+
+    if (mesh->gindex != NULL) {
+        mesh_gen_index_fini(mesh->gindex);
+        mesh->gindex = NULL;
+        mesh->indexed = res;
+    }
+
+    return res;
+}
+
+/* exported method documented in mesh_gen.h */
+bool
+mesh_gen_streamed(bitmap *bm, options *options)
+{
+    rowgenerator *rowgen;
+    rowcounter *rowcount;
+
+    return (options->merge == false) &&
+           (mesh_gen_row_finish(bm, options, &rowgen, &rowcount) != 0);
+}
+
+/* exported method documented in mesh_gen.h */
+bool
+mesh_gen_stream(bitmap *bm, options *options, mesh_gen_emit *emit, void *ctx)
+{
+    struct mesh *mesh;
+    rowgenerator *rowgen;
+    rowcounter *rowcount;
+    unsigned int rows;
+    unsigned int chunk;
+    unsigned int ystart;
+    unsigned int yend;
+    bool res = true;
+
+    mesh = new_mesh();
+    if (mesh == NULL) {
+        return false;
+    }
+
+    rows = mesh_gen_row_finish(bm, options, &rowgen, &rowcount);
+    if ((rows == 0) || options->merge) {
+        /* the whole mesh must be generated before it can be emitted */
+        res = mesh_from_bitmap(mesh, bm, options, false) && emit(mesh, ctx);
+        free_mesh(mesh);
+        return res;
+    }
+
+    mesh->height = bm->height;
+    mesh->width = bm->width;
+    mesh->lattice = (options->finish != FINISH_SMOOTH) || (options->levels == 1);
+
+    INFO("Streaming mesh from bitmap of size %dx%d with %d levels\n",
+         bm->width, bm->height, options->levels);
+
+    mesh_gen_cases_init();
+
+    if (!bitmap_spans(bm, options->transparent)) {
+        free_mesh(mesh);
+        return false;
+    }
+
+    /* each thread generates a band of every chunk */
+    chunk = GEN_STREAM_ROWS * options->threads;
+
+    for (ystart = 0; res && (ystart < rows); ystart = yend) {
+        yend = ((rows - ystart) > chunk) ? ystart + chunk : rows;
+
+        /* reuse the facet array of the previous chunk */
+        mesh->fcount = 0;
+        res = mesh_gen_rows(mesh, bm, options, rowgen, rowcount, ystart, yend) &&
+              (mesh->truncated == false) &&
+              emit(mesh, ctx);
+    }
+
+    free_mesh(mesh);
+
     return res;
 }
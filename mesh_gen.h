@@ -12,9 +12,57 @@
 #ifndef PNG23D_MESH_GEN_H
 #define PNG23D_MESH_GEN_H 1
 
+/** Number of facets a bitmap generates
+ *
+ * The count is exact for every finish except when coplanar faces are
+ * merged, where the merged faces are counted as whole squares so the count
+ * is an upper bound. Zero is returned if the facets cannot be counted.
+ *
+ * @param bm The bitmap to convert.
+ * @param options The conversion options.
+ */
+uint32_t mesh_gen_facet_count(bitmap *bm, options *options);
+
 /** Convert raster image into triangle mesh
  *
+ * @param mesh The mesh to add facets to.
+ * @param bm The bitmap to convert.
+ * @param options The conversion options.
+ * @param indexed Index the mesh vertices as the facets are generated.
+ */
+bool mesh_from_bitmap(struct mesh *mesh, bitmap *bm, options *options, bool indexed);
+
+/** Bitmap is generated a chunk of rows at a time by mesh_gen_stream()
+ *
+ * Other finishes, and merged faces, are generated whole so there is no
+ * benefit in streaming them over generating the mesh.
+ *
+ * @param bm The bitmap to convert.
+ * @param options The conversion options.
+ */
+bool mesh_gen_streamed(bitmap *bm, options *options);
+
+/** Receive the facets of a streamed mesh
+ *
+ * @param mesh The mesh holding the facets generated since the last call.
+ * @param ctx The context passed to mesh_gen_stream().
+ * @return true to continue generating or false to stop.
+ */
+typedef bool (mesh_gen_emit)(struct mesh *mesh, void *ctx);
+
+/** Convert raster image into triangle mesh a chunk of rows at a time
+ *
+ * Each chunk of rows is generated into the same mesh, replacing the facets
+ * of the previous chunk, and passed to emit so the memory used is bounded
+ * by the chunk rather than the image. Finishes not generated a row at a
+ * time and merged faces are generated whole and emitted once. The facets
+ * are never indexed.
+ *
+ * @param bm The bitmap to convert.
+ * @param options The conversion options.
+ * @param emit The function receiving each chunk of facets.
+ * @param ctx The context passed to emit.
  */
-bool mesh_from_bitmap(struct mesh *mesh, bitmap *bm, options *options);
+bool mesh_gen_stream(bitmap *bm, options *options, mesh_gen_emit *emit, void *ctx);
 
 #endif
@@ -16,14 +16,13 @@
  * - The paper "Hash Function for Triangular Mesh Reconstruction" by Václav
  *       Skala, Jan Hrádek, Martin Kuchař (Department of Computer Science and
  *       Engineering, University of West Bohemia) which provided inspiration
- *       for hash functions used in early implementations. Turns out the the
- *       simple FNV outperformed them in the end.
- * - Fowler/Noll/Vo hash From its reference implementation which is *not*
- *       subject to my copyright and is in the public domain.
+ *       for hash functions used in early implementations.
+ * - The paper "Cache-, Hash- and Space-Efficient Bloom Filters" by Felix
+ *       Putze, Peter Sanders and Johannes Singler which describes the
+ *       blocked layout where every key is confined to a single cache line.
  *
  * These served as sources of code snippets and algorihms but none of them
- * (except the FNV hash implementation) are responsible for this specific
- * implementation which is my fault.
+ * are responsible for this specific implementation which is my fault.
  */
 
 #include <stdint.h>
@@ -34,6 +33,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "option.h"
 #include "bitmap.h"
@@ -42,167 +42,147 @@
 #include "mesh_index.h"
 
 
-/* Salt values.  These salts are XORed with the output of the hash function to
- * give multiple unique hashes.
+/** Number of bits in a bloom filter block, one 64 byte cache line */
+#define BLOOM_BLOCK_BITS 512
+
+/** Number of 64 bit words in a bloom filter block */
+#define BLOOM_BLOCK_WORDS (BLOOM_BLOCK_BITS / 64)
+
+/** Largest number of blocks in a bloom filter, a 4GiB table */
+#define BLOOM_MAX_BLOCKS 0x4000000
+
+/** Initialise bloom filter
  *
- * These are "nothing up my sleeve" numbers: they are derived from the first
- * 256 numbers in the book "A Million Random Digits with 100,000 Normal
- * Deviates" published by the RAND corporation, ISBN 0-8330-3047-7.
+ * The filter is a power of two number of cache line sized blocks. Every bit
+ * set for a key is within a single block so insertion and query touch only
+ * one cache line.
  *
- * The numbers here were derived by taking each number from the book in turn,
- * then multiplying by 256 and dividing by 100,000 to give a byte range value.
- * Groups of four numbers were then combined to give 32-bit integers, most
- * significant byte first.
+ * @param mesh The mesh to initialise the filter in.
+ * @param entries The number of bits the filter should have, filters which
+ *                would exceed BLOOM_MAX_BLOCKS are limited to it.
+ * @param iterations The number of bits set for each key.
  */
-
-static const unsigned int salts[] = {
-    0x1953c322, 0x588ccf17, 0x64bf600c, 0xa6be3f3d,
-    0x341a02ea, 0x15b03217, 0x3b062858, 0x5956fd06,
-    0x18b5624f, 0xe3be0b46, 0x20ffcd5c, 0xa35dfd2b,
-    0x1fc4a9bf, 0x57c45d5c, 0xa8661c4a, 0x4f1b74d2,
-    0x5a6dde13, 0x3b18dac6, 0x05a8afbf, 0xbbda2fe2,
-    0xa2520d78, 0xe7934849, 0xd541bc75, 0x09a55b57,
-    0x9b345ae2, 0xfc2d26af, 0x38679cef, 0x81bd1e0d,
-    0x654681ae, 0x4b3d87ad, 0xd5ff10fb, 0x23b32f67,
-    0xafc7e366, 0xdd955ead, 0xe7c34b1c, 0xfeace0a6,
-    0xeb16f09d, 0x3c57a72d, 0x2c8294c5, 0xba92662a,
-    0xcd5b2d14, 0x743936c8, 0x2489beff, 0xc6c56e00,
-    0x74a4f606, 0xb244a94a, 0x5edfc423, 0xf1901934,
-    0x24af7691, 0xf6c98b25, 0xea25af46, 0x76d5f2e6,
-    0x5e33cdf2, 0x445eb357, 0x88556bd2, 0x70d1da7a,
-    0x54449368, 0x381020bc, 0x1c0520bf, 0xf7e44942,
-    0xa27e2a58, 0x66866fc5, 0x12519ce7, 0x437a8456,
-};
-
-/** Initialise bloom filter */
 static bool
 mesh_bloom_init(struct mesh *mesh,
-                unsigned int entries,
+                uint64_t entries,
                 unsigned int iterations)
 {
-    /* The salt table size imposes a limit on the number of iterations which
-     * can be applied
-     */
-    if (iterations > sizeof(salts) / sizeof(*salts)) {
+    uint64_t blocks = 64; /* always use at least 4K for the table */
+    size_t size;
+    void *table;
+
+    /* iterations must be distinct within a block */
+    if (iterations > (BLOOM_BLOCK_BITS / 2)) {
         return false;
     }
 
-    /* Always burn at least 256K for the table */
-    if (entries < (256 * 1024 * 8)) {
-        entries = (256 * 1024 * 8);
+    if (entries > ((uint64_t)BLOOM_MAX_BLOCKS * BLOOM_BLOCK_BITS)) {
+        entries = (uint64_t)BLOOM_MAX_BLOCKS * BLOOM_BLOCK_BITS;
+    }
+
+    while ((blocks * BLOOM_BLOCK_BITS) < entries) {
+        blocks = blocks << 1;
     }
 
-    /* Allocate table, each entry is one bit, packed into bytes. */
-    mesh->bloom_table = calloc(1, (entries + 7) / 8);
-    if (mesh->bloom_table == NULL) {
+    if (blocks > (SIZE_MAX / (BLOOM_BLOCK_BITS / 8))) {
         return false;
     }
+    size = (size_t)blocks * (BLOOM_BLOCK_BITS / 8);
 
+    /* Allocate table aligned so each block is exactly one cache line */
+    if (posix_memalign(&table, 64, size) != 0) {
+        return false;
+    }
+    memset(table, 0, size);
+
+    mesh->bloom_table = table;
     mesh->bloom_iterations = iterations;
-    mesh->bloom_table_entries = entries;
+    mesh->bloom_blocks = blocks;
 
     return true;
 }
 
 
-/** perform a 32 bit Fowler/Noll/Vo hash on a vetex point
+/** perform a 64 bit hash on a vertex point
  *
- * Direct from reference code which has
+ * The point is hashed as three 32 bit words which are mixed with a pair of
+ * multiplications and then finalised with the MurmurHash3 64 bit mixer so
+ * every output bit depends on every input bit.
  *
- * Please do not copyright this code.  This code is in the public domain.
+ * Adding zero to each ordinate ensures negative zero, which compares equal to
+ * zero but has a different representation, hashes the same as zero.
  */
-static inline uint32_t
+static inline uint64_t
 mesh_bloom_hash(struct pnt *pnt)
 {
-    uint32_t hval = 0; /* recommended 32 bit FNV-1 hash init */
-    unsigned char *bp = (unsigned char *)pnt;	/* start of buffer */
-    unsigned char *be = bp + sizeof(struct pnt);/* beyond end of buffer */
-
-    /*
-     * FNV-1 hash each octet in the buffer
-     */
-    while (bp < be) {
+    float ord[3];
+    uint32_t word[3];
+    uint64_t hval;
 
-        /* multiply by the 32 bit FNV magic prime mod 2^32 */
+    ord[0] = pnt->x + 0.0f;
+    ord[1] = pnt->y + 0.0f;
+    ord[2] = pnt->z + 0.0f;
+    memcpy(word, ord, sizeof(word));
 
-        /*
-         * 32 bit magic FNV-1 prime 0x01000193
-         */
-        hval += (hval<<1) + (hval<<4) + (hval<<7) + (hval<<8) + (hval<<24);
+    hval = (((uint64_t)word[0] << 32) | word[1]) * 0x9e3779b97f4a7c15ULL;
+    hval ^= (hval >> 32) ^ ((uint64_t)word[2] * 0xc2b2ae3d27d4eb4fULL);
 
-        /* xor the bottom with the current octet */
-        hval ^= (uint32_t)*bp++;
-    }
+    hval ^= hval >> 33;
+    hval *= 0xff51afd7ed558ccdULL;
+    hval ^= hval >> 33;
+    hval *= 0xc4ceb9fe1a85ec53ULL;
+    hval ^= hval >> 33;
 
-    /* return our new hash value */
     return hval;
 }
 
+/** Bloom filter block a hash selects
+ *
+ * The block is chosen with the top half of the hash leaving the bottom half
+ * to select the bits within the block.
+ */
+static inline uint64_t *
+mesh_bloom_block(struct mesh *mesh, uint64_t hash)
+{
+    return mesh->bloom_table +
+           (((uint32_t)(hash >> 32) & (mesh->bloom_blocks - 1)) *
+            BLOOM_BLOCK_WORDS);
+}
+
 static void
-mesh_bloom_insert(struct mesh *mesh, struct pnt *pnt)
+mesh_bloom_insert(struct mesh *mesh, uint64_t hash)
 {
-    unsigned int hash;
-    unsigned int subhash;
-    unsigned int index;
+    uint64_t *block = mesh_bloom_block(mesh, hash);
+    unsigned int bit = hash & (BLOOM_BLOCK_BITS - 1);
+    unsigned int step = ((hash >> 9) & (BLOOM_BLOCK_BITS - 1)) | 1;
     unsigned int iloop; /* iteration loop */
-    uint8_t entry;
-
-    /* Generate hash of the point to insert */
-    hash = mesh_bloom_hash(pnt);
 
-    /* Generate multiple unique hashes by XORing with values in the
-     * salt table.
+    /* Generate the bit indexes by double hashing, the step is odd so the
+     * indexes are distinct.
      */
-
     for (iloop = 0; iloop < mesh->bloom_iterations; ++iloop) {
+        block[bit / 64] |= (uint64_t)1 << (bit % 64);
 
-        /* Generate a unique hash */
-        subhash = hash ^ salts[iloop];
-
-        /* Find the index into the table */
-        index = subhash % mesh->bloom_table_entries;
-
-        /* Insert into the table.
-         * index / 8 finds the byte index of the table,
-         * index % 8 gives the bit index within that byte to set.
-         */
-        entry = (uint8_t) (1 << (index % 8));
-        mesh->bloom_table[index / 8] |= entry;
+        bit = (bit + step) & (BLOOM_BLOCK_BITS - 1);
     }
 }
 
 static bool
-mesh_bloom_query(struct mesh *mesh, struct pnt *pnt)
+mesh_bloom_query(struct mesh *mesh, uint64_t hash)
 {
-    unsigned int hash;
-    unsigned int subhash;
-    unsigned int index;
+    uint64_t *block = mesh_bloom_block(mesh, hash);
+    unsigned int bit = hash & (BLOOM_BLOCK_BITS - 1);
+    unsigned int step = ((hash >> 9) & (BLOOM_BLOCK_BITS - 1)) | 1;
     unsigned int iloop;
-    unsigned char entry;
-    int bit;
 
-    /* Generate hash of the value to lookup */
-    hash = mesh_bloom_hash(pnt);
-
-    /* Generate multiple unique hashes by XORing with values in the
-     * salt table. */
     for (iloop = 0; iloop < mesh->bloom_iterations; ++iloop) {
-
-        /* Generate a unique hash */
-        subhash = hash ^ salts[iloop];
-
-        /* Find the index into the table to test */
-        index = subhash % mesh->bloom_table_entries;
-
-        /* The byte at index / 8 holds the value to test */
-        entry = mesh->bloom_table[index / 8];
-        bit = 1 << (index % 8);
-
         /* Test if the particular bit is set; if it is not set,
          * this value can not have been inserted. */
-        if ((entry & bit) == 0) {
+        if ((block[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0) {
             return false;
         }
+
+        bit = (bit + step) & (BLOOM_BLOCK_BITS - 1);
     }
 
     /* All necessary bits were set.  This may indicate that the value was
@@ -212,62 +192,192 @@ mesh_bloom_query(struct mesh *mesh, struct pnt *pnt)
     return true;
 }
 
-/** Find a point in the vertex list.
+/** Query the bloom filter for all three points of a facet
  *
- * Search through the unsorted vertex list for a vertex at a given location.
- * Because of the locality of vertices being added a backward search requires
- * vastly fewer comparisons.
+ * The three blocks are requested before any are tested so the cache misses
+ * overlap rather than being taken one after another.
  *
- * In all tests backwards search reduced the mean number of comparisons before
- * a match. One representative test case this approach reduced the mean number
- * of comparisons before a match from 67803 to 606 or less than 1% of the
- * initial comparison costs.
+ * @return bitmask with bit n set if point n may be in the filter.
+ */
+static unsigned int
+mesh_bloom_query_facet(struct mesh *mesh, uint64_t hash[3])
+{
+    unsigned int res = 0;
+
+    __builtin_prefetch(mesh_bloom_block(mesh, hash[0]));
+    __builtin_prefetch(mesh_bloom_block(mesh, hash[1]));
+    __builtin_prefetch(mesh_bloom_block(mesh, hash[2]));
+
+    if (mesh_bloom_query(mesh, hash[0])) {
+        res |= 1;
+    }
+    if (mesh_bloom_query(mesh, hash[1])) {
+        res |= 2;
+    }
+    if (mesh_bloom_query(mesh, hash[2])) {
+        res |= 4;
+    }
+
+    return res;
+}
+
+/** Initialise the vertex hash index.
+ *
+ * The table is sized from the number of entries expected so in the common
+ * case (each vertex shared between several facets) it never has to grow.
+ */
+static bool
+mesh_vhash_init(struct mesh *mesh, uint32_t entries)
+{
+    uint32_t size = 1024;
+
+    while ((size < entries) && (size < 0x80000000)) {
+        size = size << 1;
+    }
+
+    mesh->vhash = calloc(size, sizeof(idxvtx));
+    if (mesh->vhash == NULL) {
+        return false;
+    }
+    mesh->vhash_size = size;
+
+    return true;
+}
+
+/** Slot in the vertex hash index at which to start probing for a hash.
+ *
+ * The bottom bits of the hash are used as the bloom filter uses the top bits
+ * to select its block.
+ */
+static inline uint32_t
+mesh_vhash_slot(struct mesh *mesh, uint64_t hash)
+{
+    return hash & (mesh->vhash_size - 1);
+}
+
+/** Place a vertex index in the first free slot of its probe sequence */
+static inline void
+mesh_vhash_place(struct mesh *mesh, uint64_t hash, idxvtx idx)
+{
+    uint32_t slot = mesh_vhash_slot(mesh, hash);
+
+    while (mesh->vhash[slot] != 0) {
+        slot = (slot + 1) & (mesh->vhash_size - 1);
+    }
+
+    mesh->vhash[slot] = idx + 1;
+}
+
+/** Double the size of the vertex hash index and re-insert every vertex */
+static bool
+mesh_vhash_grow(struct mesh *mesh)
+{
+    idxvtx *ovhash = mesh->vhash;
+    idxvtx idx;
+
+    if (mesh->vhash_size >= 0x80000000) {
+        return false;
+    }
+
+    mesh->vhash = calloc(mesh->vhash_size * 2, sizeof(idxvtx));
+    if (mesh->vhash == NULL) {
+        mesh->vhash = ovhash;
+        return false;
+    }
+    mesh->vhash_size = mesh->vhash_size * 2;
+
+    for (idx = 0; idx < mesh->vcount; idx++) {
+        mesh_vhash_place(mesh,
+                         mesh_bloom_hash(&vertex_from_index(mesh, idx)->pnt),
+                         idx);
+    }
+
+    free(ovhash);
+
+    return true;
+}
+
+/** Find a point in the vertex list.
+ *
+ * The vertex hash index is probed linearly from the slot selected by the
+ * point hash until the point or an empty slot is found. The table is kept at
+ * most half full so probe sequences remain short and the lookup cost is
+ * independent of the number of vertices already indexed.
  *
  * @param mesh The mesh to search for vertices within.
  * @param pnt The 3d point to search for.
+ * @param hash The hash of the point.
  * @return The vertex index if it is found or the next place to insert one.
  */
 static inline uint32_t
-find_pnt(struct mesh *mesh, struct pnt *pnt)
+find_pnt(struct mesh *mesh, struct pnt *pnt, uint64_t hash)
 {
-    uint32_t idx = mesh->vcount;
+    uint32_t slot = mesh_vhash_slot(mesh, hash);
+    uint32_t idx;
     struct vertex *vertex;
 
     mesh->find_count++; /* update stat */
 
-    while (idx > 0) {
-        idx--;
+    while (mesh->vhash[slot] != 0) {
+        mesh->find_cost++; /* update stat */
 
+        idx = mesh->vhash[slot] - 1;
         vertex = vertex_from_index(mesh, idx);
 
         if ((vertex->pnt.x == pnt->x) &&
             (vertex->pnt.y == pnt->y) &&
             (vertex->pnt.z == pnt->z)) {
-            mesh->find_cost += (mesh->vcount - idx); /* update stat */
             return idx;
         }
-    }
 
-    idx = mesh->vcount;
-    mesh->find_cost += idx; /* update stat */
+        slot = (slot + 1) & (mesh->vhash_size - 1);
+    }
 
-    return idx;
+    return mesh->vcount;
 }
 
-/** Add vertex to indexed list */
-static idxvtx
-mesh_add_pnt(struct mesh *mesh, struct pnt *npnt)
+/* exported interface documented in mesh_index.h */
+idxvtx
+mesh_new_vertex(struct mesh *mesh, struct pnt *npnt)
 {
-    uint32_t idx;
-    bool in_bloom;
     struct vertex *vertex;
 
-    in_bloom = mesh_bloom_query(mesh, npnt);
+    if ((mesh->vcount + 1) > mesh->valloc) {
+        /* pnt array needs extending */
+        mesh->valloc = (mesh->valloc * 2) + 1000;
+        mesh->v = realloc(mesh->v, mesh->valloc * sizeof(struct vertex));
+    }
+
+    vertex = vertex_from_index(mesh, mesh->vcount);
+    vertex->pnt = *npnt;
+    vertex->fcount = 0;
+
+    return mesh->vcount++;
+}
+
+/** Add vertex to indexed list
+ *
+ * @param mesh The mesh to add the vertex to.
+ * @param npnt The location of the vertex.
+ * @param hash The hash of the location.
+ * @param in_bloom The result of querying the bloom filter for the hash.
+ * @param idx_out Updated with the index of the vertex.
+ * @return true if the vertex was found or added, false if the hash index
+ *         could not be grown to hold it.
+ */
+static bool
+mesh_add_pnt(struct mesh *mesh,
+             struct pnt *npnt,
+             uint64_t hash,
+             bool in_bloom,
+             idxvtx *idx_out)
+{
+    uint32_t idx;
 
     if (in_bloom == false) {
         idx = mesh->vcount; /* not already in list */
     } else {
-        idx = find_pnt(mesh, npnt);
+        idx = find_pnt(mesh, npnt, hash);
 
         if (idx == mesh->vcount) {
             /* seems the bloom failed to filter this one */
@@ -277,100 +387,818 @@ mesh_add_pnt(struct mesh *mesh, struct pnt *npnt)
 
     if (idx == mesh->vcount) {
         /* not in array already */
-        if ((mesh->vcount + 1) > mesh->valloc) {
-            /* pnt array needs extending */
-            mesh->v = realloc(mesh->v,
-                              (mesh->valloc + 1000) *
-                              (sizeof(struct vertex) + (sizeof(struct facet*) * mesh->vertex_fcount)));
-            mesh->valloc += 1000;
+
+        /* keep the hash index at most half full */
+        if (((mesh->vcount + 1) > (mesh->vhash_size / 2)) &&
+            (mesh_vhash_grow(mesh) == false)) {
+            return false;
         }
 
-        mesh_bloom_insert(mesh, npnt);
+        mesh_bloom_insert(mesh, hash);
+        mesh_vhash_place(mesh, hash, idx);
 
-        vertex = vertex_from_index(mesh, idx);
-        vertex->pnt = *npnt;
-        vertex->fcount = 0;
+        mesh_new_vertex(mesh, npnt);
+    }
 
-        mesh->vcount++;
+    *idx_out = idx;
+
+    return true;
+}
+
+/** Lattice extent of a mesh */
+struct lattice {
+    int xmin; /**< smallest x coordinate */
+    int ymin; /**< smallest y coordinate */
+    int zmin; /**< smallest z coordinate */
+    uint32_t xsize; /**< number of lattice points along x axis */
+    uint32_t ysize; /**< number of lattice points along y axis */
+    uint32_t zsize; /**< number of lattice points along z axis */
+};
+
+/** Largest lattice (in entries) that will be directly addressed */
+#define LATTICE_MAX_ENTRIES (1 << 28)
+
+/** Compute the lattice extent of all the facet vertices in a mesh.
+ *
+ * @return true if every vertex lies on the integer lattice else false.
+ */
+static bool
+mesh_lattice_extent(struct mesh *mesh, struct lattice *lattice)
+{
+    struct facet *facet;
+    struct facet *fend;
+    unsigned int vloop;
+    float xmin, xmax, ymin, ymax, zmin, zmax;
+    pnt *p;
+
+    if (mesh->fcount == 0) {
+        return false;
+    }
+
+    xmin = xmax = mesh->f->v[0].x;
+    ymin = ymax = mesh->f->v[0].y;
+    zmin = zmax = mesh->f->v[0].z;
+
+    fend = mesh->f + mesh->fcount;
+
+    for (facet = mesh->f; facet < fend; facet++) {
+        for (vloop = 0; vloop < 3; vloop++) {
+            p = &facet->v[vloop];
+
+            if ((p->x != (int)p->x) ||
+                (p->y != (int)p->y) ||
+                (p->z != (int)p->z)) {
+                return false; /* off lattice */
+            }
+
+            if (p->x < xmin) xmin = p->x;
+            if (p->x > xmax) xmax = p->x;
+            if (p->y < ymin) ymin = p->y;
+            if (p->y > ymax) ymax = p->y;
+            if (p->z < zmin) zmin = p->z;
+            if (p->z > zmax) zmax = p->z;
+        }
     }
 
-    return idx;
+    lattice->xmin = xmin;
+    lattice->ymin = ymin;
+    lattice->zmin = zmin;
+    lattice->xsize = (xmax - xmin) + 1;
+    lattice->ysize = (ymax - ymin) + 1;
+    lattice->zsize = (zmax - zmin) + 1;
+
+    return true;
 }
 
-/* exported interface documented in mesh_index.h */
-bool
-add_facet_to_vertex(struct mesh *mesh,
-                    struct facet *facet,
-                    idxvtx ivertex)
+/** index a mesh whose vertices all lie on the integer lattice
+ *
+ * Each lattice point is directly addressed in a table holding its vertex
+ * index (plus one so zero marks an unused point) so no hashing or searching
+ * is required and the mesh is indexed in a single pass over its facets.
+ *
+ * @return true if the mesh was indexed else false if the mesh is not on a
+ *         suitable lattice.
+ */
+static bool
+index_mesh_lattice(struct mesh *mesh)
 {
-    struct vertex *vertex;
+    struct lattice lattice;
+    idxvtx *ltable;
+    idxvtx *lentry;
+    struct facet *facet;
+    struct facet *fend;
+    unsigned int vloop;
+    pnt *p;
+
+    if ((mesh_lattice_extent(mesh, &lattice) == false) ||
+        (((uint64_t)lattice.xsize * lattice.ysize * lattice.zsize) >
+         LATTICE_MAX_ENTRIES)) {
+        return false;
+    }
+
+    ltable = calloc((size_t)lattice.xsize * lattice.ysize * lattice.zsize,
+                    sizeof(idxvtx));
+    if (ltable == NULL) {
+        return false;
+    }
+
+    fend = mesh->f + mesh->fcount;
 
-    vertex = vertex_from_index(mesh, ivertex);
+    for (facet = mesh->f; facet < fend; facet++) {
+        for (vloop = 0; vloop < 3; vloop++) {
+            p = &facet->v[vloop];
 
-    assert(vertex->fcount < mesh->vertex_fcount);
+            lentry = ltable +
+                    (((((size_t)((int)p->z - lattice.zmin) * lattice.ysize) +
+                       ((int)p->y - lattice.ymin)) * lattice.xsize) +
+                     ((int)p->x - lattice.xmin));
 
-    vertex->facets[vertex->fcount++] = facet;
+            if (*lentry == 0) {
+                *lentry = mesh_new_vertex(mesh, p) + 1;
+            }
+
+            facet->i[vloop] = *lentry - 1;
+        }
+    }
+
+    free(ltable);
+
+    return true;
+}
+
+/** Number of key bits sorted in each radix pass */
+#define RADIX_BITS 8
+
+/** number of bits required to hold values below a limit */
+static unsigned int
+bits_for(uint32_t size)
+{
+    unsigned int bits = 0;
+
+    while ((bits < 32) && ((1ULL << bits) < size)) {
+        bits++;
+    }
+    return bits;
+}
+
+/** index a mesh by sorting its lattice points
+ *
+ * Each facet corner is packed into a 64 bit value with its exact lattice
+ * location in the top half and the corner number in the bottom half. A least
+ * significant digit radix sort on the location bits, which is stable because
+ * the corners start in ascending order, groups identical locations into runs
+ * each led by the first corner that used it. Vertex indexes are then
+ * assigned to those first corners in corner order so the numbering is the
+ * same as the other indexers with no hashing or probing.
+ *
+ * @return true if the mesh was indexed else false if the mesh is not on a
+ *         lattice small enough to pack into 32 bits.
+ */
+static bool
+index_mesh_sort(struct mesh *mesh)
+{
+    struct lattice lattice;
+    unsigned int xbits, ybits, zbits;
+    unsigned int shift;
+    uint32_t ccount = mesh->fcount * 3;
+    uint32_t corner;
+    uint32_t count[1 << RADIX_BITS];
+    uint32_t total;
+    uint32_t digit;
+    uint32_t *first;
+    uint64_t *keys;
+    uint64_t *tmp;
+    uint64_t *swap;
+    uint64_t key;
+    uint64_t run_key;
+    uint32_t run_first;
+    pnt *p;
+
+    if (mesh_lattice_extent(mesh, &lattice) == false) {
+        return false;
+    }
+
+    xbits = bits_for(lattice.xsize);
+    ybits = bits_for(lattice.ysize);
+    zbits = bits_for(lattice.zsize);
+    if ((xbits + ybits + zbits) > 32) {
+        return false;
+    }
+
+    keys = malloc(ccount * sizeof(uint64_t));
+    tmp = malloc(ccount * sizeof(uint64_t));
+    first = malloc(ccount * sizeof(uint32_t));
+    if ((keys == NULL) || (tmp == NULL) || (first == NULL)) {
+        free(keys);
+        free(tmp);
+        free(first);
+        return false;
+    }
+
+    for (corner = 0; corner < ccount; corner++) {
+        p = &mesh->f[corner / 3].v[corner % 3];
+        key = ((((uint64_t)((int)p->z - lattice.zmin) << ybits) |
+                ((int)p->y - lattice.ymin)) << xbits) |
+                ((int)p->x - lattice.xmin);
+        keys[corner] = (key << 32) | corner;
+    }
+
+    /* sort on the location bits only, the corners are already ordered */
+    for (shift = 32; shift < (32 + xbits + ybits + zbits); shift += RADIX_BITS) {
+        memset(count, 0, sizeof(count));
+        for (corner = 0; corner < ccount; corner++) {
+            count[(keys[corner] >> shift) & ((1 << RADIX_BITS) - 1)]++;
+        }
+
+        total = 0;
+        for (digit = 0; digit < (1 << RADIX_BITS); digit++) {
+            uint32_t dcount = count[digit];
+            count[digit] = total;
+            total += dcount;
+        }
+
+        for (corner = 0; corner < ccount; corner++) {
+            digit = (keys[corner] >> shift) & ((1 << RADIX_BITS) - 1);
+            tmp[count[digit]++] = keys[corner];
+        }
+
+        swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+    free(tmp);
+
+    /* every corner in a run shares the location of the first */
+    run_key = 0;
+    run_first = NO_CORNER;
+    for (corner = 0; corner < ccount; corner++) {
+        key = keys[corner];
+        if ((run_first == NO_CORNER) || ((key >> 32) != run_key)) {
+            run_key = key >> 32;
+            run_first = key & 0xffffffff;
+        }
+        first[key & 0xffffffff] = run_first;
+    }
+
+    /* assign vertex indexes in first use order, the index of each first
+     * corner is kept in the no longer required key array.
+     */
+    for (corner = 0; corner < ccount; corner++) {
+        if (first[corner] == corner) {
+            keys[corner] = mesh_new_vertex(mesh,
+                                           &mesh->f[corner / 3].v[corner % 3]);
+        }
+        mesh->f[corner / 3].i[corner % 3] = keys[first[corner]];
+    }
+
+    free(first);
+    free(keys);
 
     return true;
 }
 
 /* exported interface documented in mesh_index.h */
-bool
-remove_facet_from_vertex(struct mesh *mesh,
-                         struct facet *facet,
-                         idxvtx ivertex)
+void
+add_corner_to_vertex(struct mesh *mesh, uint32_t corner)
 {
-    unsigned int floop;
-    struct vertex *vertex;
+    idxvtx ivertex = corner_vertex(mesh, corner);
+    uint32_t first = mesh->vcorner[ivertex];
+    uint32_t last;
+
+    if (first == NO_CORNER) {
+        mesh->vcorner[ivertex] = corner;
+        mesh->cnext[corner] = corner;
+        mesh->cprev[corner] = corner;
+    } else {
+        /* the list is circular so the last corner precedes the first */
+        last = mesh->cprev[first];
+        mesh->cnext[last] = corner;
+        mesh->cprev[corner] = last;
+        mesh->cnext[corner] = first;
+        mesh->cprev[first] = corner;
+    }
 
-    vertex = vertex_from_index(mesh, ivertex);
+    vertex_from_index(mesh, ivertex)->fcount++;
+}
 
-    for (floop = 0; floop < vertex->fcount; floop++) {
-        if (vertex->facets[floop] == facet) {
-            vertex->fcount--;
-            for (; floop < vertex->fcount; floop++) {
-                vertex->facets[floop] = vertex->facets[floop + 1];
-            }
-            return true;
+/* exported interface documented in mesh_index.h */
+void
+remove_corner_from_vertex(struct mesh *mesh, uint32_t corner)
+{
+    idxvtx ivertex = corner_vertex(mesh, corner);
+
+    if (mesh->cnext[corner] == corner) {
+        /* only corner on vertex */
+        mesh->vcorner[ivertex] = NO_CORNER;
+    } else {
+        mesh->cnext[mesh->cprev[corner]] = mesh->cnext[corner];
+        mesh->cprev[mesh->cnext[corner]] = mesh->cprev[corner];
+
+        if (mesh->vcorner[ivertex] == corner) {
+            mesh->vcorner[ivertex] = mesh->cnext[corner];
         }
     }
-    fprintf(stderr,"failed to remove facet from vertex\n");
 
-    return false;
+    vertex_from_index(mesh, ivertex)->fcount--;
 }
 
-/* exported method documented in mesh_index.h */
-bool
-index_mesh(struct mesh *mesh,
-           unsigned int bloom_complexity,
-           unsigned int vertex_fcount)
+/** build the corner table topology
+ *
+ * The corners using each vertex are kept in a circular doubly linked list so
+ * walking the facets around a vertex is proportional to its valence and
+ * corners can be added and removed in constant time.
+ */
+static bool
+index_mesh_topology(struct mesh *mesh)
+{
+    uint32_t ccount = mesh->fcount * 3;
+    uint32_t corner;
+    idxvtx vloop;
+
+    mesh->vcorner = malloc(mesh->vcount * sizeof(uint32_t));
+    mesh->cnext = malloc(ccount * sizeof(uint32_t));
+    mesh->cprev = malloc(ccount * sizeof(uint32_t));
+    if ((mesh->vcorner == NULL) ||
+        (mesh->cnext == NULL) ||
+        (mesh->cprev == NULL)) {
+        return false;
+    }
+
+    for (vloop = 0; vloop < mesh->vcount; vloop++) {
+        mesh->vcorner[vloop] = NO_CORNER;
+        vertex_from_index(mesh, vloop)->fcount = 0;
+    }
+
+    for (corner = 0; corner < ccount; corner++) {
+        add_corner_to_vertex(mesh, corner);
+    }
+
+    return true;
+}
+
+/** index a mesh through the bloom filter and vertex hash index */
+static bool
+index_mesh_hash(struct mesh *mesh, unsigned int bloom_complexity)
 {
     struct facet *facet;
     struct facet *fend;
-
-    mesh->vertex_fcount = vertex_fcount;
+    uint64_t hash[3];
+    unsigned int in_bloom;
+    unsigned int vloop;
 
     /* initialise the bloom filter with enough entries for three vertex per
      * point and the complexity parameter (ok how many functions get run)
      */
-    mesh_bloom_init(mesh,
-                    mesh->fcount * bloom_complexity * 3,
-                    bloom_complexity * 2);
+    if (mesh_bloom_init(mesh,
+                        (uint64_t)mesh->fcount * bloom_complexity * 3,
+                        bloom_complexity * 2) == false) {
+        return false;
+    }
+
+    /* size the hash index from the facet count, on generated meshes each
+     * vertex is shared by several facets so there are fewer vertices than
+     * facets.
+     */
+    if (mesh_vhash_init(mesh, mesh->fcount * 2) == false) {
+        return false;
+    }
 
     fend = mesh->f + mesh->fcount;
 
     /* manufacture pointlist and update indexed geometry */
     for (facet = mesh->f; facet < fend; facet++) {
+        hash[0] = mesh_bloom_hash(&facet->v[0]);
+        hash[1] = mesh_bloom_hash(&facet->v[1]);
+        hash[2] = mesh_bloom_hash(&facet->v[2]);
+
+        in_bloom = mesh_bloom_query_facet(mesh, hash);
 
         /* update facet with indexed points */
-        facet->i[0] = mesh_add_pnt(mesh, &facet->v[0]);
-        facet->i[1] = mesh_add_pnt(mesh, &facet->v[1]);
-        facet->i[2] = mesh_add_pnt(mesh, &facet->v[2]);
+        for (vloop = 0; vloop < 3; vloop++) {
+            /* a point repeated within the facet will have been inserted
+             * since the filter was queried.
+             */
+            if (((in_bloom & (1 << vloop)) == 0) &&
+                (((vloop > 0) && (hash[vloop] == hash[0])) ||
+                 ((vloop > 1) && (hash[vloop] == hash[1])))) {
+                in_bloom |= 1 << vloop;
+            }
+
+            if (mesh_add_pnt(mesh,
+                             &facet->v[vloop],
+                             hash[vloop],
+                             (in_bloom & (1 << vloop)) != 0,
+                             &facet->i[vloop]) == false) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/** Number of shards each thread of the sharded indexer processes */
+#define SHARDS_PER_THREAD 8
+
+/** Sharded indexing state shared between the worker threads
+ *
+ * Every facet corner is hashed and the corners are partitioned into shards
+ * by the top bits of the hash so identical points always land in the same
+ * shard. Each shard is deduplicated independently, recording for every
+ * corner the first corner with the same location. Vertex indexes are then
+ * assigned to those first corners in corner order which gives exactly the
+ * same numbering as the sequential indexers.
+ */
+struct shard_index {
+    struct mesh *mesh;
+    unsigned int threads; /**< number of worker threads */
+    unsigned int shard_bits; /**< number of hash bits selecting a shard */
+    uint32_t shards; /**< number of shards */
+    uint32_t ccount; /**< number of corners */
+
+    uint64_t *hash; /**< hash of each corner location */
+    uint32_t *order; /**< corners ordered by shard then the vertex index */
+    uint32_t *first; /**< first corner with the same location */
+    uint32_t *count; /**< per thread count or offset of each shard */
+    uint32_t *start; /**< start of each shard within the order */
+    uint32_t *vstart; /**< first vertex index assigned by each thread */
+};
+
+/** Per thread context of the sharded indexer */
+struct shard_worker {
+    struct shard_index *sidx;
+    unsigned int thread; /**< thread number */
+    uint32_t cstart; /**< first corner processed by this thread */
+    uint32_t cend; /**< corner after the last processed by this thread */
+    bool ok; /**< the thread completed successfully */
+};
 
-        add_facet_to_vertex(mesh, facet, facet->i[0]);
-        add_facet_to_vertex(mesh, facet, facet->i[1]);
-        add_facet_to_vertex(mesh, facet, facet->i[2]);
+typedef void *(shard_phase)(void *ctx);
+
+/** run one phase of the sharded indexer on all the worker threads */
+static bool
+shard_run(struct shard_worker *workers, unsigned int threads, shard_phase *phase)
+{
+    pthread_t *tids;
+    unsigned int tloop;
+    unsigned int started = 0;
+    bool ok = true;
+
+    tids = malloc(threads * sizeof(pthread_t));
+    if (tids == NULL) {
+        return false;
+    }
+
+    /* the calling thread does the first workers share */
+    for (tloop = 1; tloop < threads; tloop++) {
+        workers[tloop].ok = true;
+        if (pthread_create(&tids[tloop], NULL, phase, &workers[tloop]) != 0) {
+            break;
+        }
+        started = tloop;
+    }
+    workers[0].ok = true;
+    phase(&workers[0]);
+
+    for (tloop = 1; tloop <= started; tloop++) {
+        pthread_join(tids[tloop], NULL);
+    }
+    free(tids);
+
+    if (started != (threads - 1)) {
+        return false;
+    }
+
+    for (tloop = 0; tloop < threads; tloop++) {
+        ok = ok && workers[tloop].ok;
+    }
+    return ok;
+}
+
+static inline struct pnt *
+shard_corner_pnt(struct mesh *mesh, uint32_t corner)
+{
+    return &mesh->f[corner / 3].v[corner % 3];
+}
+
+/** hash the corners of a thread and count them into shards */
+static void *
+shard_hash_phase(void *ctx)
+{
+    struct shard_worker *worker = ctx;
+    struct shard_index *sidx = worker->sidx;
+    uint32_t *count = sidx->count + (worker->thread * sidx->shards);
+    uint32_t corner;
+    uint64_t hash;
+
+    for (corner = worker->cstart; corner < worker->cend; corner++) {
+        hash = mesh_bloom_hash(shard_corner_pnt(sidx->mesh, corner));
+        sidx->hash[corner] = hash;
+        count[hash >> (64 - sidx->shard_bits)]++;
     }
 
-    return true;;
+    return NULL;
+}
+
+/** place the corners of a thread into their shards in corner order */
+static void *
+shard_scatter_phase(void *ctx)
+{
+    struct shard_worker *worker = ctx;
+    struct shard_index *sidx = worker->sidx;
+    uint32_t *offset = sidx->count + (worker->thread * sidx->shards);
+    uint32_t corner;
+
+    for (corner = worker->cstart; corner < worker->cend; corner++) {
+        sidx->order[offset[sidx->hash[corner] >> (64 - sidx->shard_bits)]++] = corner;
+    }
+
+    return NULL;
+}
+
+/** deduplicate each shard owned by a thread
+ *
+ * The shard is indexed with a private open addressed table of corners which
+ * is probed linearly from the bottom bits of the hash, the top bits are the
+ * same for every entry in the shard.
+ */
+static void *
+shard_dedup_phase(void *ctx)
+{
+    struct shard_worker *worker = ctx;
+    struct shard_index *sidx = worker->sidx;
+    uint32_t *table = NULL;
+    uint32_t table_alloc = 0;
+    uint32_t table_size;
+    uint32_t shard;
+    uint32_t oloop;
+    uint32_t corner;
+    uint32_t slot;
+    struct pnt *pnt;
+    struct pnt *opnt;
+
+    for (shard = worker->thread; shard < sidx->shards; shard += sidx->threads) {
+        uint32_t sstart = sidx->start[shard];
+        uint32_t send = sidx->start[shard + 1];
+
+        /* keep the table at most half full */
+        table_size = 16;
+        while (table_size < ((send - sstart) * 2)) {
+            table_size = table_size * 2;
+        }
+
+        if (table_size > table_alloc) {
+            free(table);
+            table = malloc(table_size * sizeof(uint32_t));
+            if (table == NULL) {
+                worker->ok = false;
+                return NULL;
+            }
+            table_alloc = table_size;
+        }
+        memset(table, 0xff, table_size * sizeof(uint32_t));
+
+        for (oloop = sstart; oloop < send; oloop++) {
+            corner = sidx->order[oloop];
+            pnt = shard_corner_pnt(sidx->mesh, corner);
+            slot = sidx->hash[corner] & (table_size - 1);
+
+            while (table[slot] != NO_CORNER) {
+                if (sidx->hash[table[slot]] == sidx->hash[corner]) {
+                    opnt = shard_corner_pnt(sidx->mesh, table[slot]);
+                    if ((opnt->x == pnt->x) &&
+                        (opnt->y == pnt->y) &&
+                        (opnt->z == pnt->z)) {
+                        break;
+                    }
+                }
+                slot = (slot + 1) & (table_size - 1);
+            }
+
+            if (table[slot] == NO_CORNER) {
+                table[slot] = corner;
+            }
+            sidx->first[corner] = table[slot];
+        }
+    }
+
+    free(table);
+
+    return NULL;
+}
+
+/** count the vertices first referenced by the corners of a thread */
+static void *
+shard_count_phase(void *ctx)
+{
+    struct shard_worker *worker = ctx;
+    struct shard_index *sidx = worker->sidx;
+    uint32_t corner;
+    uint32_t vcount = 0;
+
+    for (corner = worker->cstart; corner < worker->cend; corner++) {
+        if (sidx->first[corner] == corner) {
+            vcount++;
+        }
+    }
+    sidx->vstart[worker->thread] = vcount;
+
+    return NULL;
+}
+
+/** create the vertices first referenced by the corners of a thread
+ *
+ * The vertex index of each first corner is kept in the order array which is
+ * no longer required.
+ */
+static void *
+shard_vertex_phase(void *ctx)
+{
+    struct shard_worker *worker = ctx;
+    struct shard_index *sidx = worker->sidx;
+    struct vertex *vertex;
+    uint32_t corner;
+    idxvtx ivtx = sidx->vstart[worker->thread];
+
+    for (corner = worker->cstart; corner < worker->cend; corner++) {
+        if (sidx->first[corner] == corner) {
+            vertex = vertex_from_index(sidx->mesh, ivtx);
+            vertex->pnt = *shard_corner_pnt(sidx->mesh, corner);
+            vertex->fcount = 0;
+            sidx->order[corner] = ivtx++;
+        }
+    }
+
+    return NULL;
+}
+
+/** set the facet vertex indexes for the corners of a thread */
+static void *
+shard_facet_phase(void *ctx)
+{
+    struct shard_worker *worker = ctx;
+    struct shard_index *sidx = worker->sidx;
+    uint32_t corner;
+
+    for (corner = worker->cstart; corner < worker->cend; corner++) {
+        sidx->mesh->f[corner / 3].i[corner % 3] =
+                sidx->order[sidx->first[corner]];
+    }
+
+    return NULL;
+}
+
+/** index a mesh with several threads by partitioning the points into shards */
+static bool
+index_mesh_sharded(struct mesh *mesh, unsigned int threads)
+{
+    struct shard_index sidx;
+    struct shard_worker *workers;
+    unsigned int tloop;
+    uint32_t sloop;
+    uint32_t total;
+    uint32_t shard_count;
+    bool ok = false;
+
+    memset(&sidx, 0, sizeof(sidx));
+    sidx.mesh = mesh;
+    sidx.threads = threads;
+    sidx.ccount = mesh->fcount * 3;
+
+    sidx.shard_bits = 1;
+    while ((1U << sidx.shard_bits) < (threads * SHARDS_PER_THREAD)) {
+        sidx.shard_bits++;
+    }
+    sidx.shards = 1 << sidx.shard_bits;
+
+    workers = calloc(threads, sizeof(struct shard_worker));
+    sidx.hash = malloc(sidx.ccount * sizeof(uint64_t));
+    sidx.order = malloc(sidx.ccount * sizeof(uint32_t));
+    sidx.first = malloc(sidx.ccount * sizeof(uint32_t));
+    sidx.count = calloc(threads * sidx.shards, sizeof(uint32_t));
+    sidx.start = malloc((sidx.shards + 1) * sizeof(uint32_t));
+    sidx.vstart = malloc(threads * sizeof(uint32_t));
+    if ((workers == NULL) || (sidx.hash == NULL) || (sidx.order == NULL) ||
+        (sidx.first == NULL) || (sidx.count == NULL) ||
+        (sidx.start == NULL) || (sidx.vstart == NULL)) {
+        goto index_mesh_sharded_error;
+    }
+
+    /* each thread owns an equal contiguous range of corners */
+    for (tloop = 0; tloop < threads; tloop++) {
+        workers[tloop].sidx = &sidx;
+        workers[tloop].thread = tloop;
+        workers[tloop].cstart = ((uint64_t)sidx.ccount * tloop) / threads;
+        workers[tloop].cend = ((uint64_t)sidx.ccount * (tloop + 1)) / threads;
+    }
+
+    if (shard_run(workers, threads, shard_hash_phase) == false) {
+        goto index_mesh_sharded_error;
+    }
+
+    /* convert the counts into offsets ordered by shard then thread so each
+     * shard holds its corners in ascending order.
+     */
+    total = 0;
+    for (sloop = 0; sloop < sidx.shards; sloop++) {
+        sidx.start[sloop] = total;
+        for (tloop = 0; tloop < threads; tloop++) {
+            shard_count = sidx.count[(tloop * sidx.shards) + sloop];
+            sidx.count[(tloop * sidx.shards) + sloop] = total;
+            total += shard_count;
+        }
+    }
+    sidx.start[sidx.shards] = total;
+
+    if ((shard_run(workers, threads, shard_scatter_phase) == false) ||
+        (shard_run(workers, threads, shard_dedup_phase) == false) ||
+        (shard_run(workers, threads, shard_count_phase) == false)) {
+        goto index_mesh_sharded_error;
+    }
+
+    total = 0;
+    for (tloop = 0; tloop < threads; tloop++) {
+        shard_count = sidx.vstart[tloop];
+        sidx.vstart[tloop] = total;
+        total += shard_count;
+    }
+
+    /* the vertex count is only published once the table is complete so a
+     * failure leaves an empty vertex list for the fallback indexer.
+     */
+    free(mesh->v);
+    mesh->vcount = mesh->valloc = 0;
+    mesh->v = malloc((total + 1) * sizeof(struct vertex));
+    if (mesh->v == NULL) {
+        goto index_mesh_sharded_error;
+    }
+
+    if ((shard_run(workers, threads, shard_vertex_phase) == false) ||
+        (shard_run(workers, threads, shard_facet_phase) == false)) {
+        free(mesh->v);
+        mesh->v = NULL;
+        goto index_mesh_sharded_error;
+    }
+
+    mesh->vcount = total;
+    mesh->valloc = total + 1;
+
+    ok = true;
+
+index_mesh_sharded_error:
+    free(sidx.vstart);
+    free(sidx.start);
+    free(sidx.count);
+    free(sidx.first);
+    free(sidx.order);
+    free(sidx.hash);
+    free(workers);
+
+    return ok;
+}
+
+/* exported method documented in mesh_index.h */
+bool
+index_mesh(struct mesh *mesh, options *options, bool topology)
+{
+    bool indexed = false;
+
+    /* mesh may have been indexed as it was generated */
+    if (mesh->indexed == false) {
+        switch (options->index_method) {
+        case INDEX_AUTO:
+            if (options->threads > 1) {
+                indexed = index_mesh_sharded(mesh, options->threads);
+            } else if (mesh->lattice) {
+                /* meshes generated from bitmaps can be directly addressed */
+                indexed = index_mesh_lattice(mesh);
+            }
+            break;
+
+        case INDEX_LATTICE:
+            indexed = index_mesh_lattice(mesh);
+            break;
+
+        case INDEX_SORT:
+            indexed = index_mesh_sort(mesh);
+            break;
+
+        case INDEX_HASH:
+            break;
+        }
+
+        /* the bloom filter and hash index can index any mesh */
+        if ((indexed == false) &&
+            (index_mesh_hash(mesh, options->bloom_complexity) == false)) {
+            return false;
+        }
+        mesh->indexed = true;
+    }
+
+    /* only the simplifier walks the facets about a vertex */
+    if (topology) {
+        return index_mesh_topology(mesh);
+    }
+
+    return true;
 }
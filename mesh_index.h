@@ -12,14 +12,27 @@
 #ifndef PNG23D_MESH_INDEX_H
 #define PNG23D_MESH_INDEX_H 1
 
-/** add a facet to a vndexed vertex */
-bool add_facet_to_vertex(struct mesh *mesh, struct facet *facet, idxvtx ivertex);
+/** append a new vertex to the indexed vertex list
+ *
+ * @return The index of the new vertex.
+ */
+idxvtx mesh_new_vertex(struct mesh *mesh, struct pnt *npnt);
+
+/** add a corner to the corner list of the vertex it references */
+void add_corner_to_vertex(struct mesh *mesh, uint32_t corner);
 
-/** remove a facet to a vndexed vertex */
-bool remove_facet_from_vertex(struct mesh *mesh, struct facet *facet, idxvtx ivertex);
+/** remove a corner from the corner list of the vertex it references */
+void remove_corner_from_vertex(struct mesh *mesh, uint32_t corner);
 
-/** update the mesh geometry index representation */
-bool index_mesh(struct mesh *mesh, unsigned int bloom_complexity, unsigned int vertex_fcount);
+/** update the mesh geometry index representation
+ *
+ * @param mesh The mesh to index.
+ * @param options The indexing options, the index method, the number of
+ *                threads to index with and the bloom filter complexity used
+ *                if the mesh cannot be indexed by the selected method.
+ * @param topology Build the corner table topology used by simplify_mesh().
+ */
+bool index_mesh(struct mesh *mesh, options *options, bool topology);
 
 #endif
 
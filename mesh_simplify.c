@@ -25,6 +25,13 @@
 #include "mesh_simplify.h"
 #include "mesh_math.h"
 
+/** Largest number of facets a merged vertex may be left using.
+ *
+ * Vertex facet lists grow as required so this is not a storage limit but
+ * the candidate tests walk every facet around a vertex and unbounded fans
+ * make simplification of large meshes quadratic.
+ */
+#define SIMPLIFY_MAX_VALENCE 16
 
 
 /* debug mesh dumping */
@@ -51,12 +58,14 @@ dump_mesh_simplify(struct mesh *mesh,
     unsigned int floop;
     struct vertex *v0;
     struct vertex *v1 = NULL;
+    struct facet *f0;
 
     if (mesh->dumpfile == NULL)
         return;
 
 
     v0 = vertex_from_index(mesh, start);
+    f0 = vertex_first_facet(mesh, start);
 
     if (removing) {
         v1 = vertex_from_index(mesh, end);
@@ -68,8 +77,8 @@ dump_mesh_simplify(struct mesh *mesh,
 
     fprintf(mesh->dumpfile, "<td><svg width=\"%d\" height=\"%d\" xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\">\n", DUMP_SVG_SIZE, DUMP_SVG_SIZE);
 
-    for (floop = 0; floop < mesh->fcount; floop++) {
-        if (same_normal(&mesh->f[floop].n, &v0->facets[0]->n)) {
+    for (floop = 0; (f0 != NULL) && (floop < mesh->fcount); floop++) {
+        if (same_normal(&mesh->f[floop].n, &f0->n)) {
 
             fprintf(mesh->dumpfile,
                     "<polygon points=\"%.1f,%.1f %.1f,%.1f %.1f,%.1f\" style=\"fill:lime;stroke:black;stroke-width=1\"/>\n",
@@ -157,66 +166,62 @@ static void verify_mesh(struct mesh *mesh)
 static bool
 check_move_ok(struct mesh *mesh, unsigned int from, unsigned int to)
 {
-    unsigned int floop; /* facet loop */
-    struct vertex *fvtx; /* from vertex */
+    uint32_t first; /* first corner on from vertex */
+    uint32_t corner; /* corner loop */
+    struct facet *facet;
     struct vertex *tvtx; /* to vertex */
     bool degenerate = false;
     pnt nn;
-    pnt *v0;
-    pnt *v1;
-    pnt *v2;
+    pnt *v[3];
 
-    fvtx = vertex_from_index(mesh, from);
     tvtx = vertex_from_index(mesh, to);
 
-    for (floop = 0; floop < fvtx->fcount; floop++) {
-        if (fvtx->facets[floop]->i[0] == from) {
-            /* from vertex is position 0 */
-            v0 = &tvtx->pnt;
-            v1 = &fvtx->facets[floop]->v[1];
-            v2 = &fvtx->facets[floop]->v[2];
-        } else if (fvtx->facets[floop]->i[1] == from) {
-            /* from vertex is position 1 */
-            v0 = &fvtx->facets[floop]->v[0];
-            v1 = &tvtx->pnt;
-            v2 = &fvtx->facets[floop]->v[2];
-        } else if (fvtx->facets[floop]->i[2] == from) {
-            /* from vertex is position 2 */
-            v0 = &fvtx->facets[floop]->v[0];
-            v1 = &fvtx->facets[floop]->v[1];
-            v2 = &tvtx->pnt;
-        } else {
-            /* none of the facets verticies are the from vertex - uh oh */
-            fprintf(stderr, "none of the facets verticies are the from vertex\n");
-            return false;
-        }
+    first = mesh->vcorner[from];
+    if (first == NO_CORNER) {
+        return true;
+    }
+
+    corner = first;
+    do {
+        facet = facet_from_corner(mesh, corner);
 
-        degenerate = pnt_normal(&nn, v0, v1, v2);
+        /* the facet with the from vertex moved */
+        v[0] = &facet->v[0];
+        v[1] = &facet->v[1];
+        v[2] = &facet->v[2];
+        v[corner % 3] = &tvtx->pnt;
+
+        degenerate = pnt_normal(&nn, v[0], v[1], v[2]);
 
         /* only allow creation of degenerate facets with common verticies */
         if (degenerate) {
-            if ((nepnt(v0, v1)) && (nepnt(v1, v2)) && (nepnt(v2, v0))) {
+            if ((nepnt(v[0], v[1])) && (nepnt(v[1], v[2])) && (nepnt(v[2], v[0]))) {
                 return false;
             }
         } else {
-            if (!same_normal(&nn, &fvtx->facets[floop]->n)) {
-                //fprintf(stderr, "normal changed (%.2f, %.2f, %.2f) to (%.2f, %.2f, %.2f)\n",fvtx->facets[floop]->n.x,fvtx->facets[floop]->n.y,fvtx->facets[floop]->n.z, nn.x,nn.y,nn.z);
+            if (!same_normal(&nn, &facet->n)) {
                 return false;
             }
         }
 
-    }
+        corner = mesh->cnext[corner];
+    } while (corner != first);
+
     return true;
 }
 
 static bool remove_facet(struct mesh *mesh, struct facet *facet)
 {
     struct facet *rfacet;
+    uint32_t fcorner; /* first corner of facet */
+    uint32_t rcorner; /* first corner of the replacement facet */
+
+    fcorner = (facet - mesh->f) * 3;
 
     /* remove facet from all three vertecies */
-    remove_facet_from_vertex(mesh, facet, facet->i[0]);
-    remove_facet_from_vertex(mesh, facet, facet->i[1]);
-    remove_facet_from_vertex(mesh, facet, facet->i[2]);
+    remove_corner_from_vertex(mesh, fcorner);
+    remove_corner_from_vertex(mesh, fcorner + 1);
+    remove_corner_from_vertex(mesh, fcorner + 2);
 
     /* only way to efficiently remove a facet is to move the one at the end of
      * the list here instead
@@ -225,16 +230,18 @@ static bool remove_facet(struct mesh *mesh, struct facet *facet)
     rfacet = mesh->f + mesh->fcount;
     if (rfacet != facet) {
         /* was not already the end entry, have to do some work */
-        memcpy(facet, rfacet, sizeof(struct facet));
-        /* fix up vertex indexes */
-        remove_facet_from_vertex(mesh, rfacet, facet->i[0]);
-        remove_facet_from_vertex(mesh, rfacet, facet->i[1]);
-        remove_facet_from_vertex(mesh, rfacet, facet->i[2]);
+        rcorner = mesh->fcount * 3;
+
+        /* fix up vertex corners */
+        remove_corner_from_vertex(mesh, rcorner);
+        remove_corner_from_vertex(mesh, rcorner + 1);
+        remove_corner_from_vertex(mesh, rcorner + 2);
 
-        add_facet_to_vertex(mesh, facet, facet->i[0]);
-        add_facet_to_vertex(mesh, facet, facet->i[1]);
-        add_facet_to_vertex(mesh, facet, facet->i[2]);
+        memcpy(facet, rfacet, sizeof(struct facet));
 
+        add_corner_to_vertex(mesh, fcorner);
+        add_corner_to_vertex(mesh, fcorner + 1);
+        add_corner_to_vertex(mesh, fcorner + 2);
     }
     return true;
 }
@@ -245,8 +252,8 @@ static bool remove_facet(struct mesh *mesh, struct facet *facet)
  * changes one vertex of a factet to a new facet and updates the destination
  * vertex to reference this facet.
  *
- * @return false if from vertex was not in facet or facet could not be removed
- * from old vertex
+ * @return false if from vertex was not in facet or the facet became
+ * degenerate
  */
 static bool
 move_facet_vertex(struct mesh *mesh,
@@ -255,28 +262,29 @@ move_facet_vertex(struct mesh *mesh,
                   idxvtx to)
 {
     struct vertex *tvtx;
-    tvtx = vertex_from_index(mesh, to);
+    unsigned int vloop;
+    uint32_t corner;
 
-    if (facet->i[0] == from) {
-        facet->i[0] = to;
-        facet->v[0] = tvtx->pnt;
-    } else if (facet->i[1] == from) {
-        facet->i[1] = to;
-        facet->v[1] = tvtx->pnt;
-    } else if (facet->i[2] == from) {
-        facet->i[2] = to;
-        facet->v[2] = tvtx->pnt;
-    } else {
-        return false;
+    for (vloop = 0; vloop < 3; vloop++) {
+        if (facet->i[vloop] == from) {
+            break;
+        }
     }
-    /* add facet to destination vertex */
-    add_facet_to_vertex(mesh, facet, to);
-
-    /* remove facet from original vertex */
-    if (remove_facet_from_vertex(mesh, facet, from) == false) {
+    if (vloop == 3) {
         return false;
     }
 
+    corner = ((facet - mesh->f) * 3) + vloop;
+    tvtx = vertex_from_index(mesh, to);
+
+    /* move corner from original vertex to destination vertex */
+    remove_corner_from_vertex(mesh, corner);
+
+    facet->i[vloop] = to;
+    facet->v[vloop] = tvtx->pnt;
+
+    add_corner_to_vertex(mesh, corner);
+
     /* recompute normal */
     if (pnt_normal(&facet->n, &facet->v[0], &facet->v[1], &facet->v[2])) {
         /* triangle has become degenerate */
@@ -289,16 +297,13 @@ move_facet_vertex(struct mesh *mesh,
     return true;
 }
 
-static bool
-facet_on_vertex(struct mesh *mesh, struct facet *facet, idxvtx ivertex)
+static inline bool
+facet_on_vertex(struct facet *facet, idxvtx ivertex)
 {
-    unsigned int floop;
-
-    struct vertex *vertex = vertex_from_index(mesh, ivertex);
-
-    for (floop = 0; floop < vertex->fcount; floop++) {
-        if (vertex->facets[floop] == facet)
-            return true;
+    if ((facet->i[0] == ivertex) ||
+        (facet->i[1] == ivertex) ||
+        (facet->i[2] == ivertex)) {
+        return true;
     }
 
     return false;
@@ -309,21 +314,18 @@ static bool
 merge_edge(struct mesh *mesh, idxvtx start, idxvtx end)
 {
     struct facet *facet;
-    struct vertex *evertex;
 
     dump_mesh_simplify(mesh, true, start, end);
 
-    evertex = vertex_from_index(mesh, end);
-
     /* change all the facets on end vertex to point at start virtex
      * instead
      *
      * delete degenerate facets(two of their vertecies will be the same
      */
-    while (evertex->fcount > 0) {
-        facet = evertex->facets[0];
+    while (mesh->vcorner[end] != NO_CORNER) {
+        facet = facet_from_corner(mesh, mesh->vcorner[end]);
 
-        if (facet_on_vertex(mesh, facet, start)) {
+        if (facet_on_vertex(facet, start)) {
             remove_facet(mesh, facet); /* remove degenerate facet */
         } else {
             move_facet_vertex(mesh, facet, end, start);
@@ -336,17 +338,24 @@ merge_edge(struct mesh *mesh, idxvtx start, idxvtx end)
 }
 
 /** determinae if a vertex is topoligcally a removal candidate  */
-static bool 
+static bool
 is_candidate(struct mesh *mesh, int ivtx)
 {
-    unsigned int floop; /* facet loop */
-    struct vertex *vtx = vertex_from_index(mesh, ivtx);
+    uint32_t first = mesh->vcorner[ivtx];
+    uint32_t corner;
+
+    if (first == NO_CORNER) {
+        return true;
+    }
 
     /* Every facet at the end of the edge must have a normal which is parallel
      * and the same sign magnitude
      */
-    for (floop = 1; floop < vtx->fcount; floop++) {
-        if (!same_normal(&vtx->facets[floop - 1]->n, &vtx->facets[floop]->n))
+    for (corner = mesh->cnext[first];
+         corner != first;
+         corner = mesh->cnext[corner]) {
+        if (!same_normal(&facet_from_corner(mesh, mesh->cprev[corner])->n,
+                         &facet_from_corner(mesh, corner)->n))
             return false;
     }
 
@@ -358,19 +367,29 @@ is_candidate(struct mesh *mesh, int ivtx)
 static bool
 find_adjacent(struct mesh *mesh, unsigned int ivtx, unsigned int *avtx)
 {
-    unsigned int floop; /* facet loop */
+    uint32_t first; /* first corner on starting vertex */
+    uint32_t corner; /* corner loop */
     unsigned int vloop; /* vertex within facets */
+    struct facet *facet;
     struct vertex *vtx; /* initial vertex */
     unsigned int civtx; /* candidate vertex index */
     struct vertex *cvtx; /* candidate vertex */
 
     vtx = vertex_from_index(mesh, ivtx);
 
+    first = mesh->vcorner[ivtx];
+    if (first == NO_CORNER) {
+        return false;
+    }
+
     /* examine each facet attached to starting vertex */
-    for (floop = 0; floop < vtx->fcount; floop++) {
+    corner = first;
+    do {
+        facet = facet_from_corner(mesh, corner);
+
         /* check each vertex of this facet has */
         for (vloop = 0; vloop < 3; vloop++) {
-            civtx = vtx->facets[floop]->i[vloop];
+            civtx = facet->i[vloop];
 
             if (civtx == ivtx) {
                 continue; /* skip starting vertex */
@@ -382,10 +401,10 @@ find_adjacent(struct mesh *mesh, unsigned int ivtx, unsigned int *avtx)
 
             cvtx = vertex_from_index(mesh, civtx);
 
-            /* cannot merge edge verticies if it makes the mesh too
-             * complicated to represent
+            /* cannot merge edge verticies if it makes the fan around the
+             * start vertex too large
              */
-            if (((vtx->fcount + cvtx->fcount) - 2) > mesh->vertex_fcount) {
+            if (((vtx->fcount + cvtx->fcount) - 2) > SIMPLIFY_MAX_VALENCE) {
                 continue;
             }
 
@@ -396,11 +415,11 @@ find_adjacent(struct mesh *mesh, unsigned int ivtx, unsigned int *avtx)
             /* found something suitable */
             *avtx = civtx;
             return true;
+        }
 
+        corner = mesh->cnext[corner];
+    } while (corner != first);
 
-
-        }
-    }
     return false; /* no match */
 }
 
@@ -418,8 +437,9 @@ simplify_mesh(struct mesh *mesh)
     unsigned int vloop = 0;
     unsigned int vtx1;
 
-    /* ensure index tables are up to date */
+    /* ensure index tables and topology are up to date */
     assert(mesh->v != NULL);
+    assert(mesh->vcorner != NULL);
 
     dump_mesh_simplify_init(mesh);
 
@@ -43,10 +43,12 @@ read_options(int argc, char **argv)
     options->height = 0.0;
     options->depth = 1.0;
     options->bloom_complexity = 2;
-    options->vertex_complexity = 16;
+    options->threads = 1;
+    options->index_method = INDEX_AUTO;
+    options->tolerance = -1.0;
 
     /* parse comamndline options */
-    while ((opt = getopt(argc, argv, "Vvf:w:d:h:m:t:l:o:O:b:c:")) != -1) {
+    while ((opt = getopt(argc, argv, "Vvgf:w:d:h:m:t:l:o:O:b:j:i:e:")) != -1) {
         switch (opt) {
 
         case 't': /* transparent colour */
@@ -79,6 +81,10 @@ read_options(int argc, char **argv)
                 options->finish = FINISH_SMOOTH; /* Marching squares mesh */
             } else if (strcmp(optarg, "surface") == 0) {
                 options->finish = FINISH_SURFACE; /* heightmap surface */
+            } else if (strcmp(optarg, "extrude") == 0) {
+                options->finish = FINISH_EXTRUDE; /* extruded outline */
+            } else if (strcmp(optarg, "terrace") == 0) {
+                options->finish = FINISH_TERRACE; /* terraced marching squares */
             } else {
                 fprintf(stderr, "Unknown output finish %s\n", optarg);
                 goto read_options_error;
@@ -127,10 +133,25 @@ read_options(int argc, char **argv)
             }
             break;
 
-        case 'c': /* indexed vertex complexity */
-            options->vertex_complexity = strtoul(optarg, NULL, 0);
-            if (options->vertex_complexity > 128) {
-                fprintf(stderr, "vertex complexity must be between 8 and 128\n");
+        case 'j': /* generation and indexing threads */
+            options->threads = strtoul(optarg, NULL, 0);
+            if ((options->threads < 1) || (options->threads > 256)) {
+                fprintf(stderr, "threads must be between 1 and 256\n");
+                goto read_options_error;
+            }
+            break;
+
+        case 'i': /* vertex index method */
+            if (strcmp(optarg, "auto") == 0) {
+                options->index_method = INDEX_AUTO;
+            } else if (strcmp(optarg, "hash") == 0) {
+                options->index_method = INDEX_HASH;
+            } else if (strcmp(optarg, "lattice") == 0) {
+                options->index_method = INDEX_LATTICE;
+            } else if (strcmp(optarg, "sort") == 0) {
+                options->index_method = INDEX_SORT;
+            } else {
+                fprintf(stderr, "Unknown index method %s\n", optarg);
                 goto read_options_error;
             }
             break;
@@ -139,6 +160,18 @@ read_options(int argc, char **argv)
             options->meshdebug = strdup(optarg);
             break;
 
+        case 'e': /* adaptive surface error tolerance */
+            options->tolerance = strtof(optarg, NULL);
+            if ((options->tolerance < 0) || (options->tolerance > 256)) {
+                fprintf(stderr, "surface tolerance must be between 0 and 256\n");
+                goto read_options_error;
+            }
+            break;
+
+        case 'g': /* merge coplanar faces */
+            options->merge = true;
+            break;
+
         case 'V':
             fprintf(stderr, "png23d version %d.%02d\n",
                     VERSION / 100, VERSION % 100);
@@ -155,10 +188,8 @@ read_options(int argc, char **argv)
     }
 
 
-    if (((options->finish == FINISH_RECT) ||
-         (options->finish == FINISH_SMOOTH)) &&
-        (options->levels != 1)) {
-        fprintf(stderr, "Rectangular Cuboid and Marching square finish only support a single level\n");
+    if ((options->finish == FINISH_EXTRUDE) && (options->levels != 1)) {
+        fprintf(stderr, "Extruded finish only supports a single level\n");
         goto read_options_error;
     }
 
@@ -174,9 +205,11 @@ read_options(int argc, char **argv)
 
 read_options_error:
     fprintf(stderr,
-            "Usage: png23d [-t transparent] [-V] [-v] [-f finish] [-O optimisation]\n"
+            "Usage: png23d [-t transparent] [-V] [-v] [-g] [-f finish] [-O optimisation]\n"
             "              [-w width] [-h height] [-d depth] [-l levels] [-o outtype]\n"
-            "              [-b complexity] [-m filename] infile outfile\n\n"
+            "              [-b complexity] [-j threads] [-i method] [-e tolerance]\n"
+            "              [-m filename]\n"
+            "              infile outfile\n\n"
             "\tinfile\tThe input file\n"
             "\toutfile\tThe output file or - for stdout\n"
             "\t-l\tNumber of levels to quantise the heightmap into.\n"
@@ -32,6 +32,15 @@ enum output_finish {
     FINISH_RECT,
     FINISH_SMOOTH,
     FINISH_SURFACE,
+    FINISH_EXTRUDE,
+    FINISH_TERRACE,
+};
+
+enum index_method {
+    INDEX_AUTO, /* index while generating or pick the best method */
+    INDEX_HASH, /* bloom filter and hash index */
+    INDEX_LATTICE, /* directly addressed lattice */
+    INDEX_SORT, /* radix sorted lattice points */
 };
 
 typedef struct options {
@@ -50,9 +59,13 @@ typedef struct options {
                                     * for the bloom filter
                                     */
 
-    unsigned int vertex_complexity; /* The number of facets a vertex can refer
-                                    * to.
-                                    */
+    unsigned int threads; /* number of threads used to generate and index the mesh */
+
+    enum index_method index_method; /* how mesh vertices are indexed */
+
+    bool merge; /* merge coplanar faces as the mesh is generated */
+
+    float tolerance; /* adaptive surface height error, negative for a grid */
 
     bool verbose; /* make tool verbose about operations */
 
@@ -48,7 +48,7 @@ bool output_flat_scad_polyhedron(bitmap *bm, int fd, options *options)
 
     debug_mesh_init(mesh, options->meshdebug);
 
-    if (mesh_from_bitmap(mesh, bm, options) == false) {
+    if (mesh_from_bitmap(mesh, bm, options, true) == false) {
         fprintf(stderr,"unable to convert bitmap to mesh\n");
         return false;
     }
@@ -56,17 +56,24 @@ bool output_flat_scad_polyhedron(bitmap *bm, int fd, options *options)
     start_vcount = mesh->fcount * 3; /* each facet has 3 vertex */
 
     INFO("Indexing %d vertices\n", start_vcount);
-    index_mesh(mesh, options->bloom_complexity, options->vertex_complexity);
-
-    INFO("Bloom filter prevented %d (%d%%) lookups\n",
-         start_vcount - mesh->find_count,
-         ((start_vcount - mesh->find_count) * 100) / start_vcount);
-    INFO("Bloom filter had %d (%d%%) false positives\n",
-         mesh->bloom_miss,
-         (mesh->bloom_miss * 100) / (mesh->find_count));
-    INFO("Indexing required %d lookups with mean search cost " D64F " comparisons\n",
-         mesh->find_count,
-         mesh->find_cost / mesh->find_count);
+    if (index_mesh(mesh, options, options->optimise > 0) == false) {
+        fprintf(stderr,"unable to index mesh\n");
+        free_mesh(mesh);
+        return false;
+    }
+
+    /* lattice indexing performs no lookups */
+    if (mesh->find_count > 0) {
+        INFO("Bloom filter prevented %d (%d%%) lookups\n",
+             start_vcount - mesh->find_count,
+             ((start_vcount - mesh->find_count) * 100) / start_vcount);
+        INFO("Bloom filter had %d (%d%%) false positives\n",
+             mesh->bloom_miss,
+             (mesh->bloom_miss * 100) / (mesh->find_count));
+        INFO("Indexing required %d lookups with mean search cost " D64F " comparisons\n",
+             mesh->find_count,
+             mesh->find_cost / mesh->find_count);
+    }
 
     if (options->optimise > 0) {
         INFO("Simplification of mesh with %d facets using %d unique verticies\n",
@@ -78,6 +85,9 @@ bool output_flat_scad_polyhedron(bitmap *bm, int fd, options *options)
              mesh->fcount, mesh->vcount);
     }
 
+    /* only the indexed form of the mesh is output */
+    compact_mesh(mesh);
+
     xoff = (bm->width / 2);
     yoff = (bm->height / 2);
 
@@ -100,9 +110,9 @@ bool output_flat_scad_polyhedron(bitmap *bm, int fd, options *options)
 
     for (tloop = 0; tloop < mesh->fcount; tloop++) {
         fprintf(outf, "[%u,%u,%u],\n",
-                mesh->f[tloop].i[0],
-                mesh->f[tloop].i[1],
-                mesh->f[tloop].i[2] );
+                facet_index(mesh, tloop, 0),
+                facet_index(mesh, tloop, 1),
+                facet_index(mesh, tloop, 2));
     }
 
 
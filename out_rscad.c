@@ -27,20 +27,28 @@ output_scad_cube(FILE *outf, int x,int y, int z, int width, int height, int dept
             width, height, depth);
 }
 
-/* generate scad output as rows of cubes */
+/* generate scad output as rows of cubes
+ *
+ * Each run of opaque pixels on a row becomes a cube so only the runs are
+ * visited and empty areas of the image cost nothing.
+ */
 bool output_flat_scad_cubes(bitmap *bm, int fd, options *options)
 {
     int xoff; /* x offset so 3d model is centered */
     int yoff; /* y offset so 3d model is centered */
     unsigned int row_loop;
-    unsigned int col_loop;
-    unsigned int col_start; /* start col of run */
+    uint32_t span_loop;
+    bitmap_span *span;
     unsigned int xmin = bm->width;
     unsigned int xmax = 0;
     unsigned int ymin = bm->height;
     unsigned int ymax = 0;
     FILE *outf;
 
+    if (!bitmap_spans(bm, options->transparent)) {
+        return false;
+    }
+
     outf = fdopen(dup(fd), "w");
 
     xoff = (bm->width / 2);
@@ -54,43 +62,24 @@ bool output_flat_scad_cubes(bitmap *bm, int fd, options *options)
     fprintf(outf, "module image(sx,sy,sz) {\n scale([sx, sy, sz]) union() {\n");
 
     for (row_loop = 0; row_loop < bm->height; row_loop++) {
-        col_start = bm->width;
-        for (col_loop = 0; col_loop < bm->width; col_loop++) {
-            
-            if (bm->data[(row_loop * bm->width) + col_loop] != options->transparent) {
-                /* this cell is "opaque" */
-                if (col_start > col_loop) {
-                    /* mark start of run */
-                    col_start = col_loop;
-                }
-                if (col_loop < xmin)
-                    xmin = col_loop;
-                if (col_loop > xmax)
-                    xmax = col_loop;
-                if (row_loop < ymin)
-                    ymin = row_loop;
-                if (row_loop > ymax)
-                    ymax = row_loop;
-
-            } else {
-                /* cell is transparent */
-                if (col_start < col_loop) {
-                    /* output previous run */
-                    output_scad_cube(outf,
-                                     col_start - xoff, yoff - row_loop , 0,
-                                     col_loop - col_start, 1, 1);
-                    col_start = bm->width; /* ready for next run */
-                }
-            }
-        }
-        /* need to close any active run at edge of image */
-        if (col_start < col_loop) {
-            /* output active run */
+        for (span_loop = bm->span_row[row_loop];
+             span_loop < bm->span_row[row_loop + 1];
+             span_loop++) {
+            span = bm->span + span_loop;
+
             output_scad_cube(outf,
-                             col_start - xoff, row_loop - yoff, 0,
-                             col_loop - col_start, 1, 1);
-        }
+                             span->start - xoff, yoff - row_loop, 0,
+                             span->end - span->start, 1, 1);
 
+            if (span->start < xmin)
+                xmin = span->start;
+            if ((span->end - 1) > xmax)
+                xmax = span->end - 1;
+            if (row_loop < ymin)
+                ymin = row_loop;
+            if (row_loop > ymax)
+                ymax = row_loop;
+        }
     }
 
     fprintf(outf, "    }\n}\n\n");
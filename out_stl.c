@@ -26,6 +26,16 @@
 #include "out_stl.h"
 
 
+/** report the scaling applied to the mesh */
+static void stl_info(bitmap *bm, options *options)
+{
+    INFO("width bitmap:%d output:%f\n",bm->width, options->width);
+    INFO("width scale is 1:%f\n", options->width / bm->width);
+
+    INFO("height bitmap:%d output:%f\n",options->levels, options->depth);
+    INFO("height scale is 1:%f\n", options->depth / options->levels);
+}
+
 static struct mesh *stl_mesh(bitmap *bm, int fd, options *options)
 {
     struct mesh *mesh;
@@ -38,7 +48,7 @@ static struct mesh *stl_mesh(bitmap *bm, int fd, options *options)
 
     debug_mesh_init(mesh, options->meshdebug);
 
-    if (mesh_from_bitmap(mesh, bm, options) == false) {
+    if (mesh_from_bitmap(mesh, bm, options, options->optimise > 0) == false) {
         fprintf(stderr,"unable to convert bitmap to mesh with requested finish\n");
         free_mesh(mesh);
         return NULL;
@@ -48,39 +58,113 @@ static struct mesh *stl_mesh(bitmap *bm, int fd, options *options)
         uint32_t start_vcount = mesh->fcount * 3; /* each facet has 3 vertex */
 
         INFO("Indexing %d vertices\n", start_vcount);
-        index_mesh(mesh, options->bloom_complexity, options->vertex_complexity);
+        if (index_mesh(mesh, options, true) == false) {
+            fprintf(stderr,"unable to index mesh\n");
+            free_mesh(mesh);
+            return NULL;
+        }
 
         INFO("Simplification of mesh with %d facets using %d unique verticies\n",
              mesh->fcount, start_vcount);
 
         simplify_mesh(mesh);
 
-        INFO("Bloom filter prevented %d (%d%%) lookups\n",
-             start_vcount - mesh->find_count,
-             ((start_vcount - mesh->find_count) * 100) / start_vcount);
+        /* the facet vertex copies are no longer required */
+        compact_mesh(mesh);
 
-        INFO("Bloom filter had %d (%d%%) false positives\n",
-             mesh->bloom_miss,
-             (mesh->bloom_miss * 100) / (mesh->find_count));
+        /* lattice indexing performs no lookups */
+        if (mesh->find_count > 0) {
+            INFO("Bloom filter prevented %d (%d%%) lookups\n",
+                 start_vcount - mesh->find_count,
+                 ((start_vcount - mesh->find_count) * 100) / start_vcount);
 
-        INFO("Indexing required %d lookups with mean search cost " D64F " comparisons\n",
-             mesh->find_count,
-             mesh->find_cost / mesh->find_count);
+            INFO("Bloom filter had %d (%d%%) false positives\n",
+                 mesh->bloom_miss,
+                 (mesh->bloom_miss * 100) / (mesh->find_count));
+
+            INFO("Indexing required %d lookups with mean search cost " D64F " comparisons\n",
+                 mesh->find_count,
+                 mesh->find_cost / mesh->find_count);
+        }
 
         INFO("Result mesh has %d facets using %d unique verticies\n",
              mesh->fcount, mesh->vcount);
     }
 
-    INFO("width bitmap:%d output:%f\n",bm->width, options->width);
-    INFO("width scale is 1:%f\n", options->width / bm->width);
-
-    INFO("height bitmap:%d output:%f\n",options->levels, options->depth);
-    INFO("height scale is 1:%f\n", options->depth / options->levels);
+    stl_info(bm, options);
 
     return mesh;
 }
 
 
+/** Number of triangles written to a binary STL file at a time */
+#define STL_WRITE_FACETS 4096
+
+/** binary STL triangle record */
+struct binstltri {
+    pnt n; /**< surface normal */
+    pnt v[3]; /**< triangle vertices */
+    uint16_t attribute;
+} __attribute__((packed));
+
+/** binary STL file being written */
+struct stl_writer {
+    int fd;
+    float xscale;
+    float zscale;
+    struct binstltri *buf; /**< triangles waiting to be written */
+    unsigned int balloc; /**< number of triangles the buffer holds */
+    uint32_t fcount; /**< number of triangles written */
+};
+
+/** Unoptimised meshes need not be held whole so are streamed as generated
+ *
+ * Finishes which are only generated whole are written from the mesh so their
+ * triangles need not be counted separately.
+ */
+static inline bool stl_stream(bitmap *bm, options *options)
+{
+    return (options->optimise == 0) &&
+           (options->meshdebug == NULL) &&
+           mesh_gen_streamed(bm, options);
+}
+
+/** write the facets of a mesh as scaled binary STL triangles */
+static bool stl_write_facets(struct mesh *mesh, void *ctx)
+{
+    struct stl_writer *writer = ctx;
+    struct binstltri *binstltri;
+    struct pnt *vpnt;
+    unsigned int floop;
+    unsigned int vloop;
+    unsigned int bcount = 0;
+
+    for (floop = 0; floop < mesh->fcount; floop++) {
+        binstltri = writer->buf + bcount++;
+
+        /* copy vertex points with scaling */
+        binstltri->n = *facet_normal(mesh, floop);
+        for (vloop = 0; vloop < 3; vloop++) {
+            vpnt = facet_pnt(mesh, floop, vloop);
+            binstltri->v[vloop].x = vpnt->x * writer->xscale;
+            binstltri->v[vloop].y = vpnt->y * writer->xscale;
+            binstltri->v[vloop].z = vpnt->z * writer->zscale;
+        }
+        binstltri->attribute = 0;
+
+        if ((bcount == writer->balloc) || ((floop + 1) == mesh->fcount)) {
+            if (write(writer->fd, writer->buf, bcount * sizeof(struct binstltri)) !=
+                (ssize_t)(bcount * sizeof(struct binstltri))) {
+                return false;
+            }
+            bcount = 0;
+        }
+    }
+    writer->fcount += mesh->fcount;
+
+    return true;
+}
+
 /* binary stl output
  *
  * UINT8[80] – Header
@@ -94,30 +178,49 @@ static struct mesh *stl_mesh(bitmap *bm, int fd, options *options)
  * UINT16 – Attribute byte count
  * end
  *
+ * Streamed meshes have their triangles counted before they are generated,
+ * should that differ from the number written the count is corrected if the
+ * output is seekable.
  */
 bool output_flat_stl(bitmap *bm, int fd, options *options)
 {
-    struct mesh *mesh;
-    unsigned int floop;
+    struct mesh *mesh = NULL;
+    struct stl_writer writer;
+    uint32_t fcount;
     uint8_t header[80];
     bool ret = true;
-    struct binstltri {
-            pnt n; /**< surface normal */
-            pnt v[3]; /**< triangle vertices */
-            uint16_t attribute;
-    } __attribute__((packed)) binstltri;
-    float xscale = options->width / bm->width;
-    float zscale = options->depth / options->levels;
 
     assert(sizeof(struct binstltri) == 50); /* this is foul and nasty */
 
-    mesh = stl_mesh(bm, fd, options);
-    if (mesh == NULL) {
-        return false;
+    writer.fd = fd;
+    writer.xscale = options->width / bm->width;
+    writer.zscale = options->depth / options->levels;
+    writer.fcount = 0;
+
+    if (stl_stream(bm, options)) {
+        fcount = mesh_gen_facet_count(bm, options);
+        stl_info(bm, options);
+    } else {
+        mesh = stl_mesh(bm, fd, options);
+        if (mesh == NULL) {
+            return false;
+        }
+        fcount = mesh->fcount;
     }
 
     INFO("Writing Binary STL output\n");
 
+    /* the triangles are written a buffer at a time */
+    writer.balloc = STL_WRITE_FACETS;
+    if ((mesh != NULL) && (mesh->fcount < writer.balloc)) {
+        writer.balloc = mesh->fcount + 1;
+    }
+    writer.buf = malloc(writer.balloc * sizeof(struct binstltri));
+    if (writer.buf == NULL) {
+        ret = false;
+        goto output_flat_stl_error;
+    }
+
     /* write file header */
     memset(header, 0, 80);
     snprintf((char *)header, 80,
@@ -128,41 +231,50 @@ bool output_flat_stl(bitmap *bm, int fd, options *options)
     }
 
     /* write number of triangles in file */
-    if (write(fd, &mesh->fcount, sizeof(uint32_t)) != sizeof(uint32_t)) {
+    if (write(fd, &fcount, sizeof(uint32_t)) != sizeof(uint32_t)) {
         ret = false;
         goto output_flat_stl_error;
     }
 
-    binstltri.attribute = 0;
-
     /* write each triangle after scaling */
-    for (floop=0; floop < mesh->fcount; floop++) {
-        /* copy vertex points with scaling */
-        binstltri.n = mesh->f[floop].n;
-        binstltri.v[0].x = mesh->f[floop].v[0].x * xscale;
-        binstltri.v[0].y = mesh->f[floop].v[0].y * xscale;
-        binstltri.v[0].z = mesh->f[floop].v[0].z * zscale;
-        binstltri.v[1].x = mesh->f[floop].v[1].x * xscale;
-        binstltri.v[1].y = mesh->f[floop].v[1].y * xscale;
-        binstltri.v[1].z = mesh->f[floop].v[1].z * zscale;
-        binstltri.v[2].x = mesh->f[floop].v[2].x * xscale;
-        binstltri.v[2].y = mesh->f[floop].v[2].y * xscale;
-        binstltri.v[2].z = mesh->f[floop].v[2].z * zscale;
-
-        if (write(fd, &binstltri, sizeof(struct binstltri)) != sizeof(struct binstltri)) {
+    if (mesh != NULL) {
+        ret = stl_write_facets(mesh, &writer);
+    } else {
+        ret = mesh_gen_stream(bm, options, stl_write_facets, &writer);
+    }
+
+    if (ret && (writer.fcount != fcount)) {
+        if ((lseek(fd, 80, SEEK_SET) != 80) ||
+            (write(fd, &writer.fcount, sizeof(uint32_t)) != sizeof(uint32_t)) ||
+            (lseek(fd, 0, SEEK_END) < 0)) {
+            fprintf(stderr, "unable to correct triangle count of unseekable output\n");
             ret = false;
-            break;
         }
     }
 
 output_flat_stl_error:
-    free_mesh(mesh);
+    free(writer.buf);
+    if (mesh != NULL) {
+        free_mesh(mesh);
+    }
 
     return ret;
 }
 
-static inline void output_stl_tri(FILE *outf, const struct facet *facet, float xscale, float zscale)
+/** ASCII STL file being written */
+struct astl_writer {
+    FILE *outf;
+    float xscale;
+    float zscale;
+};
+
+static inline void output_stl_tri(FILE *outf, struct mesh *mesh, uint32_t fidx, float xscale, float zscale)
 {
+    struct pnt *n = facet_normal(mesh, fidx);
+    struct pnt *v0 = facet_pnt(mesh, fidx, 0);
+    struct pnt *v1 = facet_pnt(mesh, fidx, 1);
+    struct pnt *v2 = facet_pnt(mesh, fidx, 2);
+
     fprintf(outf,
             "  facet normal %.6f %.6f %.6f\n"
             "    outer loop\n"
@@ -171,41 +283,62 @@ static inline void output_stl_tri(FILE *outf, const struct facet *facet, float x
             "      vertex %.6f %.6f %.6f\n"
             "    endloop\n"
             "  endfacet\n",
-            facet->n.x, facet->n.y, facet->n.z,
-            facet->v[0].x * xscale, facet->v[0].y * xscale, facet->v[0].z * zscale,
-            facet->v[1].x * xscale, facet->v[1].y * xscale, facet->v[1].z * zscale,
-            facet->v[2].x * xscale, facet->v[2].y * xscale, facet->v[2].z * zscale);
+            n->x, n->y, n->z,
+            v0->x * xscale, v0->y * xscale, v0->z * zscale,
+            v1->x * xscale, v1->y * xscale, v1->z * zscale,
+            v2->x * xscale, v2->y * xscale, v2->z * zscale);
 }
 
-/* ascii stl outout */
-bool output_flat_astl(bitmap *bm, int fd, options *options)
+/** write the facets of a mesh as scaled ASCII STL facets */
+static bool astl_write_facets(struct mesh *mesh, void *ctx)
 {
-    struct mesh *mesh;
+    struct astl_writer *writer = ctx;
     unsigned int floop;
-    FILE *outf;
 
-    mesh = stl_mesh(bm, fd, options);
-    if (mesh == NULL) {
-        return false;
+    for (floop = 0; floop < mesh->fcount; floop++) {
+        output_stl_tri(writer->outf,
+                       mesh,
+                       floop,
+                       writer->xscale,
+                       writer->zscale);
+    }
+
+    return ferror(writer->outf) == 0;
+}
+
+/* ascii stl outout */
+bool output_flat_astl(bitmap *bm, int fd, options *options)
+{
+    struct mesh *mesh = NULL;
+    struct astl_writer writer;
+    bool ret;
+
+    if (stl_stream(bm, options)) {
+        stl_info(bm, options);
+    } else {
+        mesh = stl_mesh(bm, fd, options);
+        if (mesh == NULL) {
+            return false;
+        }
     }
 
     INFO("Writing ASCII STL output\n");
-    outf = fdopen(dup(fd), "w");
+    writer.outf = fdopen(dup(fd), "w");
+    writer.xscale = options->width / bm->width;
+    writer.zscale = options->depth / options->levels;
 
-    fprintf(outf, "solid png2stl_Model\n");
+    fprintf(writer.outf, "solid png2stl_Model\n");
 
-    for (floop = 0; floop < mesh->fcount; floop++) {
-        output_stl_tri(outf,
-                       mesh->f + floop,
-                       options->width / bm->width,
-                       options->depth / options->levels );
+    if (mesh != NULL) {
+        ret = astl_write_facets(mesh, &writer);
+        free_mesh(mesh);
+    } else {
+        ret = mesh_gen_stream(bm, options, astl_write_facets, &writer);
     }
 
-    fprintf(outf, "endsolid png2stl_Model\n");
-
-    free_mesh(mesh);
+    fprintf(writer.outf, "endsolid png2stl_Model\n");
 
-    fclose(outf);
+    fclose(writer.outf);
 
-    return true;
+    return ret;
 }